@@ -0,0 +1,260 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "blockio.h"
+
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+
+#define BLOCKIO_THREADS 8
+
+// Finish a request (or what is left of it) with plain pread/pwrite
+static int run_sync(struct blockio_req *req, size_t done){
+  while (done < req->len){
+    char *buf = (char *) req->buf + done;
+    ssize_t n = req->write ? pwrite(req->fd, buf, req->len - done, req->off + done)
+      : pread(req->fd, buf, req->len - done, req->off + done);
+    if (n < 0){
+      if (errno == EINTR){
+        continue;
+      }
+      return errno;
+    }
+    if (n == 0){ // read past the end of the file
+      return EIO;
+    }
+    done += n;
+  }
+  return 0;
+}
+
+#ifdef HAVE_IO_URING
+
+struct uring {
+  int fd;
+  unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned int *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring, *cq_ring;
+  size_t sq_len, cq_len, sqes_len;
+};
+
+static void uring_close(struct uring *r){
+  munmap(r->sqes, r->sqes_len);
+  if (r->cq_ring != r->sq_ring){
+    munmap(r->cq_ring, r->cq_len);
+  }
+  munmap(r->sq_ring, r->sq_len);
+  close(r->fd);
+}
+
+static int uring_setup(struct uring *r, unsigned int entries){
+  struct io_uring_params p;
+
+  memset(&p, 0, sizeof(p));
+  r->fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (r->fd < 0){
+    return -1;
+  }
+
+  r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP){
+    if (r->cq_len > r->sq_len){
+      r->sq_len = r->cq_len;
+    }
+    r->cq_len = r->sq_len;
+  }
+  r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  r->sq_ring = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+    r->fd, IORING_OFF_SQ_RING);
+  if (r->sq_ring == MAP_FAILED){
+    close(r->fd);
+    return -1;
+  }
+  r->cq_ring = r->sq_ring;
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP)){
+    r->cq_ring = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      r->fd, IORING_OFF_CQ_RING);
+    if (r->cq_ring == MAP_FAILED){
+      munmap(r->sq_ring, r->sq_len);
+      close(r->fd);
+      return -1;
+    }
+  }
+  r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+    r->fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED){
+    if (r->cq_ring != r->sq_ring){
+      munmap(r->cq_ring, r->cq_len);
+    }
+    munmap(r->sq_ring, r->sq_len);
+    close(r->fd);
+    return -1;
+  }
+
+  char *sq = r->sq_ring, *cq = r->cq_ring;
+  r->sq_head = (unsigned int *)(sq + p.sq_off.head);
+  r->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+  r->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned int *)(sq + p.sq_off.array);
+  r->cq_head = (unsigned int *)(cq + p.cq_off.head);
+  r->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+  r->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return 0;
+}
+
+// Keep the ring topped up with requests and reap completions until all
+// of them are done. Short transfers are finished synchronously. If the
+// ring stops accepting work, the requests it already took are waited for
+// (their buffers belong to the kernel until then) and the rest are done
+// with pread/pwrite.
+static int run_uring(struct uring *r, struct blockio_req *reqs, unsigned int count){
+  unsigned int next = 0, done = 0, unsubmitted = 0;
+  int err = 0, broken = 0;
+
+  while (done < next || (next < count && !broken && err == 0)){
+    unsigned int tail = *r->sq_tail;
+    while (next < count && next - done < BLOCKIO_DEPTH && err == 0 && !broken){
+      unsigned int idx = tail & *r->sq_mask;
+      struct io_uring_sqe *sqe = &r->sqes[idx];
+      struct blockio_req *req = &reqs[next];
+
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = req->write ? IORING_OP_WRITE : IORING_OP_READ;
+      sqe->fd = req->fd;
+      sqe->addr = (unsigned long) req->buf;
+      sqe->len = req->len;
+      sqe->off = req->off;
+      sqe->user_data = next;
+      r->sq_array[idx] = idx;
+
+      tail++;
+      next++;
+      unsubmitted++;
+    }
+    __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+    if (done == next){ // stopped early on an error
+      break;
+    }
+
+    int ret = syscall(__NR_io_uring_enter, r->fd, unsubmitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    if (ret < 0 && errno != EINTR){
+      if (!broken){
+        // take back the entries the kernel has not picked up; without
+        // SQPOLL it only does so inside io_uring_enter
+        unsigned int taken = tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        __atomic_store_n(r->sq_tail, tail - taken, __ATOMIC_RELEASE);
+        next -= taken;
+        unsubmitted = 0;
+        broken = 1;
+      } else {
+        // still waiting on the ones it did take
+        sched_yield();
+      }
+    } else if (ret > 0){
+      unsubmitted -= ret;
+    }
+
+    unsigned int head = *r->cq_head;
+    while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)){
+      struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+      struct blockio_req *req = &reqs[cqe->user_data];
+      int res;
+
+      if (cqe->res < 0){
+        // e.g. a kernel without IORING_OP_READ/WRITE, retry the plain way
+        res = run_sync(req, 0);
+      } else {
+        res = run_sync(req, cqe->res);
+      }
+      if (res && err == 0){
+        err = res;
+      }
+      head++;
+      done++;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  // whatever the ring never got to
+  for (; next < count && err == 0; next++){
+    err = run_sync(&reqs[next], 0);
+  }
+  return err;
+}
+
+#endif
+
+struct pool {
+  struct blockio_req *reqs;
+  unsigned int count;
+  unsigned int next;
+  int err;
+};
+
+static void *pool_worker(void *arg){
+  struct pool *pool = arg;
+  unsigned int i;
+
+  while ((i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->count){
+    int err = run_sync(&pool->reqs[i], 0);
+    if (err){
+      __atomic_store_n(&pool->err, err, __ATOMIC_RELAXED);
+    }
+  }
+  return NULL;
+}
+
+// Fallback: blocking pread/pwrite spread over a few threads
+static int run_pool(struct blockio_req *reqs, unsigned int count){
+  struct pool pool = {reqs, count, 0, 0};
+  unsigned int nthreads = count < BLOCKIO_THREADS ? count : BLOCKIO_THREADS;
+  pthread_t threads[BLOCKIO_THREADS];
+  unsigned int i, started = 0;
+
+  for (i = 0; i < nthreads; i++){
+    if (pthread_create(&threads[i], NULL, pool_worker, &pool) == 0){
+      started++;
+    }
+  }
+  if (started == 0){
+    pool_worker(&pool);
+  }
+  for (i = 0; i < started; i++){
+    pthread_join(threads[i], NULL);
+  }
+  return pool.err;
+}
+
+int blockio_run(struct blockio_req *reqs, unsigned int count){
+  if (count == 0){
+    return 0;
+  }
+  if (count == 1){
+    return run_sync(&reqs[0], 0);
+  }
+
+#ifdef HAVE_IO_URING
+  struct uring ring;
+  if (uring_setup(&ring, BLOCKIO_DEPTH) == 0){
+    int err = run_uring(&ring, reqs, count);
+    uring_close(&ring);
+    return err;
+  }
+#endif
+
+  return run_pool(reqs, count);
+}
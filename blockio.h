@@ -0,0 +1,27 @@
+#ifndef BLOCKIO_H
+#define BLOCKIO_H
+
+#include <sys/types.h>
+
+/*
+ * Batched block I/O for the paths that go through pread/pwrite rather than
+ * the mmap (currently the overlay delta). Requests are run through an
+ * io_uring with up to BLOCKIO_DEPTH in flight; where io_uring is missing
+ * or disabled they are spread over a small pool of threads instead.
+ */
+
+#define BLOCKIO_DEPTH 64
+
+struct blockio_req {
+  int    fd;
+  int    write;   // 0 reads into buf, 1 writes buf out
+  void  *buf;
+  size_t len;
+  off_t  off;
+};
+
+// Perform every request, in any order. Returns 0, or the errno of a
+// request that failed.
+int blockio_run(struct blockio_req *reqs, unsigned int count);
+
+#endif
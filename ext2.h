@@ -97,6 +97,23 @@ struct ext2_super_block {
 	unsigned int   s_reserved[190]; /* Padding to the end of the block */
 };
 
+#define    EXT2_SUPER_MAGIC  0xEF53
+#define    EXT2_VALID_FS     0x0001  /* Unmounted cleanly */
+#define    EXT2_ERRORS_CONTINUE 1    /* Continue execution */
+#define    EXT2_DYNAMIC_REV  1       /* V2 format w/ dynamic inode sizes */
+
+/*
+ * Feature set definitions
+ */
+#define    EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001
+#define    EXT2_FEATURE_INCOMPAT_FILETYPE      0x0002
+/*
+ * Small directories kept inside the inode (see EXT2_INLINE_DATA_FL). The
+ * layout is our own rather than ext4's, so it uses a bit no other tool
+ * knows about and they refuse the image instead of misreading it.
+ */
+#define    EXT2_FEATURE_INCOMPAT_INLINE_DATA   0x80000000
+
 
 
 
@@ -145,10 +162,23 @@ struct ext2_inode {
 	unsigned int   extra[3];
 };
 
+/*
+ * Inode flags
+ */
+#define    EXT2_INLINE_DATA_FL   0x10000000 /* Data stored in i_block */
+
+/*
+ * With EXT2_INLINE_DATA_FL set, i_block holds the data itself: for a
+ * directory, ordinary ext2_dir_entry_2 records (starting with "." and "..")
+ * spanning all EXT2_INLINE_DATA_SIZE bytes.
+ */
+#define    EXT2_INLINE_DATA_SIZE (15 * sizeof(unsigned int))
+
 /*
  * Type field for file mode
  */
 
+#define    EXT2_S_IFMT   0xF000    /* mask for the type bits */
 /* #define EXT2_S_IFSOCK 0xC000 */ /* socket */
 #define    EXT2_S_IFLNK  0xA000    /* symbolic link */
 #define    EXT2_S_IFREG  0x8000    /* regular file */
@@ -209,6 +239,13 @@ struct ext2_dir_entry_2 {
 	char           name[];    /* File name, up to EXT2_NAME_LEN */
 };
 
+/*
+ * Space a directory entry with a name of name_len bytes takes up on disk,
+ * rounded up to a multiple of 4 bytes.
+ */
+#define EXT2_DIR_REC_LEN(name_len) \
+	((sizeof(struct ext2_dir_entry_2) + (name_len) + 3) & ~3)
+
 /*
  * Ext2 directory file types.  Only the low 3 bits are used.  The
  * other bits are reserved for now.
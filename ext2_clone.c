@@ -0,0 +1,85 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <linux/fs.h>
+#include "ext2.h"
+#include "overlay.h"
+
+// Full copy through the kernel, which may still share extents or offload
+// the copy to the server on filesystems that support it
+int copy_image(int src_fd, int dst_fd){
+    struct stat st;
+    if (fstat(src_fd, &st) == -1){
+        return -1;
+    }
+
+    off_t left = st.st_size;
+    while (left > 0){
+        ssize_t n = copy_file_range(src_fd, NULL, dst_fd, NULL, left, 0);
+        if (n <= 0){
+            return -1;
+        }
+        left -= n;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int full_copy = 0;
+
+    if (argc == 4 && strcmp(argv[1], "-c") == 0) {
+        full_copy = 1;
+        argv++;
+    } else if (argc != 3) {
+        fprintf(stderr, "Usage: ext2_clone [-c] <image file name> <clone file name>\n");
+        exit(1);
+    }
+
+    int src_fd = open(argv[1], O_RDONLY);
+    if (src_fd == -1) {
+        perror(argv[1]);
+        return ENOENT;
+    }
+    if (overlay_detect(src_fd)) {
+        fprintf(stderr, "%s: cannot clone an overlay\n", argv[1]);
+        return EINVAL;
+    }
+
+    int dst_fd = open(argv[2], O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (dst_fd == -1) {
+        perror(argv[2]);
+        return EEXIST;
+    }
+
+    if (full_copy) {
+        if (copy_image(src_fd, dst_fd) == -1) {
+            perror("copy_file_range");
+            unlink(argv[2]);
+            exit(1);
+        }
+        printf("copied\n");
+        return 0;
+    }
+
+    // share the base image's extents if the host filesystem can
+    if (ioctl(dst_fd, FICLONE, src_fd) == 0) {
+        printf("reflinked\n");
+        return 0;
+    }
+
+    // otherwise keep the base read-only and collect changes in an overlay
+    close(dst_fd);
+    unlink(argv[2]);
+    if (overlay_create(argv[1], argv[2]) == -1) {
+        exit(1);
+    }
+    printf("overlay\n");
+    return 0;
+}
@@ -0,0 +1,393 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include "ext2.h"
+#include "shared.h"
+#include "stats.h"
+
+#define MAX_BLOCK_SIZE 4096
+#define MAX_BLOCKS   (12 + MAX_BLOCK_SIZE / sizeof(unsigned int))  // no double indirect
+
+// Fragmentation metrics, gathered before and after the passes
+struct frag_stats {
+    unsigned int dirs;
+    unsigned int dir_blocks;
+    unsigned int files;
+    unsigned int file_blocks;
+    unsigned int extents;          // runs of physically contiguous blocks
+    unsigned int fragmented;       // inodes with more than one extent
+    unsigned int skipped;          // sparse or double indirect inodes
+};
+
+// A live directory entry copied out while its directory is repacked
+struct saved_entry {
+    unsigned int  inode;
+    unsigned char name_len;
+    unsigned char file_type;
+    char          name[EXT2_NAME_LEN];
+};
+
+static struct ext2_group_desc *gd;
+
+int inode_in_use(unsigned int inode_idx){
+    unsigned int group = (inode_idx - 1) / sb->s_inodes_per_group;
+    unsigned int bit = (inode_idx - 1) % sb->s_inodes_per_group;
+    unsigned char *bitmap = disk + block_size * gd[group].bg_inode_bitmap;
+    return bitmap[bit / 8] & (1 << (bit % 8));
+}
+
+// Skip the reserved inodes other than the root
+int inode_is_user(unsigned int inode_idx){
+    unsigned int first_ino = sb->s_rev_level >= EXT2_DYNAMIC_REV ?
+        sb->s_first_ino : EXT2_GOOD_OLD_FIRST_INO;
+    return inode_idx == EXT2_ROOT_INO || inode_idx >= first_ino;
+}
+
+// Only directories and regular files have block lists we may touch; device
+// inodes keep their device number in i_block
+int inode_has_blocks(struct ext2_inode *inode){
+    unsigned int type = inode->i_mode & EXT2_S_IFMT;
+    return (type == EXT2_S_IFDIR || type == EXT2_S_IFREG) &&
+        !(inode->i_flags & EXT2_INLINE_DATA_FL) && inode->i_blocks > 0;
+}
+
+/*
+ * Collect pointers to the data block pointers of an inode, in file order, so
+ * callers can both read and rewrite them. Returns the block count, or -1 if
+ * the inode has holes or uses double/triple indirect blocks.
+ */
+int get_block_slots(struct ext2_inode *inode, unsigned int **slots){
+    unsigned int count = 0, i;
+    int hole = 0;
+
+    for (i = 0; i < 12; i++){
+        if (inode->i_block[i] == 0){
+            hole = 1;
+        } else if (hole){
+            return -1;
+        } else {
+            slots[count++] = &inode->i_block[i];
+        }
+    }
+    if (inode->i_block[13] || inode->i_block[14]){
+        return -1;
+    }
+    if (inode->i_block[12]){
+        if (hole){
+            return -1;
+        }
+        unsigned int *data_blocks = (unsigned int *)(disk + inode->i_block[12] * block_size);
+        for (i = 0; i < block_size / sizeof(unsigned int); i++){
+            if (data_blocks[i] == 0){
+                hole = 1;
+            } else if (hole){
+                return -1;
+            } else {
+                slots[count++] = &data_blocks[i];
+            }
+        }
+    }
+    return count;
+}
+
+int count_extents(unsigned int **slots, int count){
+    int extents = count > 0, i;
+    for (i = 1; i < count; i++){
+        if (*slots[i] != *slots[i - 1] + 1){
+            extents++;
+        }
+    }
+    return extents;
+}
+
+void gather_stats(struct frag_stats *stats){
+    unsigned int *slots[MAX_BLOCKS];
+    unsigned int inode_idx;
+
+    memset(stats, 0, sizeof(*stats));
+    for (inode_idx = 1; inode_idx <= sb->s_inodes_count; inode_idx++){
+        if (!inode_is_user(inode_idx) || !inode_in_use(inode_idx)){
+            continue;
+        }
+        struct ext2_inode *inode = get_inode_by_idx(inode_idx);
+        if (!inode_has_blocks(inode)){
+            continue;
+        }
+
+        int count = get_block_slots(inode, slots);
+        if (count == -1){
+            stats->skipped++;
+            continue;
+        }
+        int extents = count_extents(slots, count);
+
+        if ((inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR){
+            stats->dirs++;
+            stats->dir_blocks += count;
+        } else {
+            stats->files++;
+            stats->file_blocks += count;
+        }
+        stats->extents += extents;
+        stats->fragmented += extents > 1;
+    }
+}
+
+// Sort entries by name, keeping "." and ".." in front
+void sort_entries(struct saved_entry *entries, unsigned int entry_count){
+    unsigned int a, b;
+    for (a = 3; a < entry_count; a++){
+        struct saved_entry key = entries[a];
+        for (b = a; b > 2; b--){
+            struct saved_entry *prev = &entries[b - 1];
+            int len = prev->name_len < key.name_len ? prev->name_len : key.name_len;
+            int cmp = memcmp(prev->name, key.name, len);
+            if (cmp < 0 || (cmp == 0 && prev->name_len <= key.name_len)){
+                break;
+            }
+            entries[b] = *prev;
+        }
+        entries[b] = key;
+    }
+}
+
+// Blocks needed to pack the entries back to back in the given order
+unsigned int packed_block_count(const struct saved_entry *entries,
+    unsigned int entry_count){
+    unsigned int blocks = 1, offset = 0, e;
+    for (e = 0; e < entry_count; e++){
+        unsigned int rec_len = EXT2_DIR_REC_LEN(entries[e].name_len);
+        if (offset + rec_len > block_size){
+            blocks++;
+            offset = 0;
+        }
+        offset += rec_len;
+    }
+    return blocks;
+}
+
+/*
+ * Rewrite a directory's live entries back to back from its first block,
+ * optionally sorted by name, and free the blocks left over.
+ */
+void repack_directory(struct ext2_inode *inode, int sort){
+    unsigned int *slots[MAX_BLOCKS];
+    int count = get_block_slots(inode, slots);
+    if (count <= 0){
+        return;
+    }
+
+    struct saved_entry *entries = malloc(count * (block_size / 8) * sizeof(struct saved_entry));
+    unsigned int entry_count = 0;
+    int i;
+    if (entries == NULL){
+        perror("malloc");
+        exit(1);
+    }
+
+    for (i = 0; i < count; i++){
+        unsigned char *block = disk + *slots[i] * block_size;
+        unsigned char *curr = block;
+        while (curr < block + block_size){
+            struct ext2_dir_entry_2 *dir_entry = (struct ext2_dir_entry_2 *) curr;
+            if (dir_entry->rec_len == 0){
+                break;
+            }
+            if (dir_entry->inode && dir_entry->name_len){
+                struct saved_entry *saved = &entries[entry_count++];
+                saved->inode = dir_entry->inode;
+                saved->name_len = dir_entry->name_len;
+                saved->file_type = dir_entry->file_type;
+                memcpy(saved->name, dir_entry->name, dir_entry->name_len);
+            }
+            curr += dir_entry->rec_len;
+        }
+    }
+
+    // Packing in on-disk order always fits in the blocks the entries came
+    // from, but a sorted order can leave bigger gaps at block ends and need
+    // one more. Only sort if the result still fits.
+    if (sort && entry_count > 2){
+        size_t len = entry_count * sizeof(struct saved_entry);
+        struct saved_entry *sorted = malloc(len);
+        if (sorted == NULL){
+            perror("malloc");
+            exit(1);
+        }
+        memcpy(sorted, entries, len);
+        sort_entries(sorted, entry_count);
+        if (packed_block_count(sorted, entry_count) <= (unsigned int) count){
+            free(entries);
+            entries = sorted;
+        } else {
+            free(sorted);
+        }
+    }
+
+    int used = 0;
+    unsigned int offset = 0, e;
+    unsigned char *block = disk + *slots[0] * block_size;
+    struct ext2_dir_entry_2 *last = NULL;
+    memset(block, 0, block_size);
+    for (e = 0; e < entry_count; e++){
+        unsigned int rec_len = EXT2_DIR_REC_LEN(entries[e].name_len);
+        if (offset + rec_len > block_size){
+            // stretch the block's last record to its end, move on to the next
+            last->rec_len += block_size - offset;
+            block = disk + *slots[++used] * block_size;
+            memset(block, 0, block_size);
+            offset = 0;
+        }
+        last = (struct ext2_dir_entry_2 *)(block + offset);
+        last->inode = entries[e].inode;
+        last->rec_len = rec_len;
+        last->name_len = entries[e].name_len;
+        last->file_type = entries[e].file_type;
+        memcpy(last->name, entries[e].name, entries[e].name_len);
+        offset += rec_len;
+    }
+    if (last){
+        last->rec_len += block_size - offset;
+    } else {
+        // no live entries at all; keep one empty record spanning the block
+        ((struct ext2_dir_entry_2 *) block)->rec_len = block_size;
+    }
+    free(entries);
+
+    for (i = used + 1; i < count; i++){
+        free_block(*slots[i]);
+        *slots[i] = 0;
+    }
+    unsigned int blocks = used + 1;
+    if (blocks <= 12 && inode->i_block[12]){
+        free_block(inode->i_block[12]);
+        inode->i_block[12] = 0;
+    }
+    inode->i_size = blocks * block_size;
+    inode->i_blocks = (blocks + (inode->i_block[12] != 0)) * (block_size / 512);
+}
+
+int block_in_use(unsigned int group, unsigned int bit){
+    unsigned char *bitmap = disk + block_size * gd[group].bg_block_bitmap;
+    return bitmap[bit / 8] & (1 << (bit % 8));
+}
+
+// Find and claim count free blocks in a row within one group, 0 if none
+unsigned int claim_free_run(unsigned int count){
+    unsigned int groups = get_group_count();
+    unsigned int group;
+
+    for (group = 0; group < groups; group++){
+        if (gd[group].bg_free_blocks_count < count){
+            continue;
+        }
+        unsigned int group_blocks = sb->s_blocks_count - sb->s_first_data_block
+            - group * sb->s_blocks_per_group;
+        if (group_blocks > sb->s_blocks_per_group){
+            group_blocks = sb->s_blocks_per_group;
+        }
+
+        unsigned int bit, run = 0;
+        for (bit = 0; bit < group_blocks; bit++){
+            run = block_in_use(group, bit) ? 0 : run + 1;
+            if (run == count){
+                unsigned int first = bit + 1 - count;
+                unsigned char *bitmap = disk + block_size * gd[group].bg_block_bitmap;
+                for (bit = first; bit < first + count; bit++){
+                    bitmap[bit / 8] |= 1 << (bit % 8);
+                }
+                gd[group].bg_free_blocks_count -= count;
+                sb->s_free_blocks_count -= count;
+                return group * sb->s_blocks_per_group + first + sb->s_first_data_block;
+            }
+        }
+    }
+    return 0;
+}
+
+// Move a fragmented inode's data blocks into one contiguous run
+void relocate_blocks(struct ext2_inode *inode){
+    unsigned int *slots[MAX_BLOCKS];
+    int count = get_block_slots(inode, slots);
+    if (count <= 1 || count_extents(slots, count) == 1){
+        return;
+    }
+
+    unsigned int first = claim_free_run(count);
+    if (first == 0){
+        return;
+    }
+
+    int i;
+    for (i = 0; i < count; i++){
+        memcpy(disk + (first + i) * block_size, disk + *slots[i] * block_size,
+            block_size);
+        free_block(*slots[i]);
+        *slots[i] = first + i;
+    }
+}
+
+void print_stats(const struct frag_stats *before, const struct frag_stats *after){
+    printf("%-18s %10s %10s\n", "", "before", "after");
+    printf("%-18s %10u %10u\n", "directories", before->dirs, after->dirs);
+    printf("%-18s %10u %10u\n", "directory blocks", before->dir_blocks, after->dir_blocks);
+    printf("%-18s %10u %10u\n", "files", before->files, after->files);
+    printf("%-18s %10u %10u\n", "file blocks", before->file_blocks, after->file_blocks);
+    printf("%-18s %10u %10u\n", "extents", before->extents, after->extents);
+    printf("%-18s %10u %10u\n", "fragmented inodes", before->fragmented, after->fragmented);
+    printf("%-18s %10u %10u\n", "skipped inodes", before->skipped, after->skipped);
+}
+
+int main(int argc, char **argv) {
+    stats_init(&argc, argv);
+    int sort = 0;
+
+    if (argc == 3 && strcmp(argv[1], "-s") == 0) {
+        sort = 1;
+        argv++;
+    } else if (argc != 2) {
+        fprintf(stderr, "Usage: ext2_defrag [-s] <image file name>\n");
+        exit(1);
+    }
+
+    if (disk_init(argv[1]) == -1) {
+        return ENOENT;
+    }
+    gd = get_group_desc();
+
+    struct frag_stats before, after;
+    gather_stats(&before);
+
+    // repack directories first so the blocks they give up can be reused;
+    // lost+found keeps its preallocated blocks for fsck
+    unsigned int lost_found_idx = get_inode_idx_by_path("/lost+found");
+    unsigned int inode_idx;
+    for (inode_idx = 1; inode_idx <= sb->s_inodes_count; inode_idx++) {
+        if (!inode_is_user(inode_idx) || !inode_in_use(inode_idx) ||
+            inode_idx == lost_found_idx) {
+            continue;
+        }
+        struct ext2_inode *inode = get_inode_by_idx(inode_idx);
+        if (inode_has_blocks(inode) && (inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR) {
+            repack_directory(inode, sort);
+        }
+    }
+
+    for (inode_idx = 1; inode_idx <= sb->s_inodes_count; inode_idx++) {
+        if (!inode_is_user(inode_idx) || !inode_in_use(inode_idx)) {
+            continue;
+        }
+        struct ext2_inode *inode = get_inode_by_idx(inode_idx);
+        if (inode_has_blocks(inode)) {
+            relocate_blocks(inode);
+        }
+    }
+
+    gather_stats(&after);
+    print_stats(&before, &after);
+    return 0;
+}
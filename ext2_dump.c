@@ -0,0 +1,308 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <pthread.h>
+#include "ext2.h"
+#include "shared.h"
+#include "stats.h"
+
+/*
+ * Binary output format, all integers little endian:
+ *
+ *   header   char magic[8] = DUMP_MAGIC
+ *   batch    unsigned int rows, path_bytes
+ *            then one array per column, rows entries each:
+ *            ino, mode, links, size, blocks, atime, ctime, mtime, path_end
+ *            (mode and links are unsigned short, the rest unsigned int;
+ *            path_end[i] is the end offset of row i's path)
+ *            then char paths[path_bytes], not NUL terminated
+ *   ...
+ *   trailer  a batch with rows = 0
+ */
+#define DUMP_MAGIC       "EXT2DMP1"
+#define BATCH_ROWS       4096
+#define BATCH_PATH_BYTES (256 * 1024)
+#define MAX_PATH_LEN     4096
+
+struct batch {
+    unsigned int   rows;
+    unsigned int   path_bytes;
+    unsigned int   ino[BATCH_ROWS];
+    unsigned short mode[BATCH_ROWS];
+    unsigned short links[BATCH_ROWS];
+    unsigned int   size[BATCH_ROWS];
+    unsigned int   blocks[BATCH_ROWS];
+    unsigned int   atime[BATCH_ROWS];
+    unsigned int   ctime[BATCH_ROWS];
+    unsigned int   mtime[BATCH_ROWS];
+    unsigned int   path_end[BATCH_ROWS];
+    char           paths[BATCH_PATH_BYTES];
+};
+
+static unsigned char *visited;       // directories already walked, 1 bit per inode
+static unsigned int next_group;      // next group for a scan worker
+static struct batch out_batch;
+static FILE *out;
+static int csv;
+static int damaged;                  // a block pointer was out of range
+static volatile unsigned int sink;   // keeps the pass 1 reads alive
+
+/*
+ * Pass 1: read every group's inode table front to back, a group per worker
+ * at a time, so pass 2's jumps around the tables hit memory rather than
+ * the disk. Nothing is copied out: pass 2 reads the attributes straight
+ * from the mapping, which keeps memory use independent of the inode count
+ * (apart from the visited bitmap).
+ */
+void *scan_groups(void *arg){
+    struct ext2_group_desc *gd = get_group_desc();
+    unsigned int groups = get_group_count();
+    size_t table_len = (size_t) sb->s_inodes_per_group * get_inode_size();
+    long page_size = sysconf(_SC_PAGESIZE);
+    unsigned int group, sum = 0;
+
+    while ((group = __atomic_fetch_add(&next_group, 1, __ATOMIC_RELAXED)) < groups){
+        const unsigned char *table = disk + block_size * gd[group].bg_inode_table;
+        size_t off;
+        for (off = 0; off < table_len; off += page_size){
+            sum += table[off];
+        }
+    }
+    sink += sum;
+    return NULL;
+}
+
+void write_or_die(const void *buf, size_t len){
+    if (len && fwrite(buf, len, 1, out) != 1){
+        perror("ext2_dump: write");
+        exit(1);
+    }
+}
+
+void flush_batch(){
+    struct batch *b = &out_batch;
+    unsigned int rows = b->rows;
+
+    write_or_die(&b->rows, sizeof(b->rows));
+    write_or_die(&b->path_bytes, sizeof(b->path_bytes));
+    write_or_die(b->ino, rows * sizeof(b->ino[0]));
+    write_or_die(b->mode, rows * sizeof(b->mode[0]));
+    write_or_die(b->links, rows * sizeof(b->links[0]));
+    write_or_die(b->size, rows * sizeof(b->size[0]));
+    write_or_die(b->blocks, rows * sizeof(b->blocks[0]));
+    write_or_die(b->atime, rows * sizeof(b->atime[0]));
+    write_or_die(b->ctime, rows * sizeof(b->ctime[0]));
+    write_or_die(b->mtime, rows * sizeof(b->mtime[0]));
+    write_or_die(b->path_end, rows * sizeof(b->path_end[0]));
+    write_or_die(b->paths, b->path_bytes);
+    b->rows = 0;
+    b->path_bytes = 0;
+}
+
+void emit_row(unsigned int ino, const char *path, unsigned int path_len){
+    struct ext2_inode *inode = get_inode_by_idx(ino);
+
+    if (csv){
+        unsigned int i;
+        fputc('"', out);
+        for (i = 0; i < path_len; i++){
+            if (path[i] == '"'){
+                fputc('"', out);
+            }
+            fputc(path[i], out);
+        }
+        fprintf(out, "\",%u,%o,%u,%u,%u,%u,%u,%u\n", ino, inode->i_mode,
+            inode->i_links_count, inode->i_size, inode->i_blocks, inode->i_atime,
+            inode->i_ctime, inode->i_mtime);
+        return;
+    }
+
+    struct batch *b = &out_batch;
+    if (b->rows == BATCH_ROWS || b->path_bytes + path_len > BATCH_PATH_BYTES){
+        flush_batch();
+    }
+    unsigned int row = b->rows++;
+    b->ino[row] = ino;
+    b->mode[row] = inode->i_mode;
+    b->links[row] = inode->i_links_count;
+    b->size[row] = inode->i_size;
+    b->blocks[row] = inode->i_blocks;
+    b->atime[row] = inode->i_atime;
+    b->ctime[row] = inode->i_ctime;
+    b->mtime[row] = inode->i_mtime;
+    memcpy(b->paths + b->path_bytes, path, path_len);
+    b->path_bytes += path_len;
+    b->path_end[row] = b->path_bytes;
+}
+
+void walk_directory(unsigned int dir_ino, char *path, unsigned int path_len);
+
+// Only real directories are walked: the type bits of block devices and
+// sockets overlap EXT2_S_IFDIR, and their i_block holds no block numbers
+int entry_is_dir(const struct ext2_dir_entry_2 *dir_entry){
+    if ((get_inode_by_idx(dir_entry->inode)->i_mode & EXT2_S_IFMT) != EXT2_S_IFDIR){
+        return 0;
+    }
+    return !(sb->s_feature_incompat & EXT2_FEATURE_INCOMPAT_FILETYPE) ||
+        dir_entry->file_type == EXT2_FT_DIR;
+}
+
+// Emit every entry packed into len bytes, descending into subdirectories
+void walk_entries(const unsigned char *data, unsigned int len, char *path,
+    unsigned int path_len){
+    const unsigned char *curr = data;
+
+    while (curr < data + len){
+        struct ext2_dir_entry_2 *dir_entry = (struct ext2_dir_entry_2 *) curr;
+        if (dir_entry->rec_len == 0){
+            break;
+        }
+        curr += dir_entry->rec_len;
+
+        if (dir_entry->inode == 0 || dir_entry->inode > sb->s_inodes_count ||
+            (dir_entry->name_len == 1 && dir_entry->name[0] == '.') ||
+            (dir_entry->name_len == 2 && strncmp(dir_entry->name, "..", 2) == 0)){
+            continue;
+        }
+        if (path_len + 1 + dir_entry->name_len >= MAX_PATH_LEN){
+            fprintf(stderr, "ext2_dump: path too long under %.*s\n", path_len, path);
+            continue;
+        }
+
+        unsigned int child_len = path_len;
+        if (child_len > 1){
+            path[child_len++] = '/';
+        }
+        memcpy(path + child_len, dir_entry->name, dir_entry->name_len);
+        child_len += dir_entry->name_len;
+
+        emit_row(dir_entry->inode, path, child_len);
+        if (entry_is_dir(dir_entry)){
+            walk_directory(dir_entry->inode, path, child_len);
+        }
+    }
+}
+
+// Walk the directory blocks under a block pointer, depth levels of
+// indirection down (0 for a data block)
+void walk_blocks(unsigned int dir_ino, unsigned int block_idx, int depth,
+    char *path, unsigned int path_len){
+    if (block_idx == 0){
+        return;
+    }
+    if (block_idx >= sb->s_blocks_count){
+        fprintf(stderr, "ext2_dump: inode %u: bad block %u, entries under %.*s skipped\n",
+            dir_ino, block_idx, path_len, path);
+        damaged = 1;
+        return;
+    }
+
+    const unsigned char *block = disk + (size_t) block_idx * block_size;
+    if (depth == 0){
+        walk_entries(block, block_size, path, path_len);
+        return;
+    }
+    const unsigned int *data_blocks = (const unsigned int *) block;
+    unsigned int i;
+    for (i = 0; i < block_size / sizeof(unsigned int); i++){
+        walk_blocks(dir_ino, data_blocks[i], depth - 1, path, path_len);
+    }
+}
+
+/*
+ * Pass 2: walk the directory tree once, emitting each entry's name with
+ * its inode's attributes.
+ */
+void walk_directory(unsigned int dir_ino, char *path, unsigned int path_len){
+    if (visited[(dir_ino - 1) / 8] & (1 << ((dir_ino - 1) % 8))){
+        return;
+    }
+    visited[(dir_ino - 1) / 8] |= 1 << ((dir_ino - 1) % 8);
+
+    struct ext2_inode *inode = get_inode_by_idx(dir_ino);
+    if (inode->i_flags & EXT2_INLINE_DATA_FL){
+        walk_entries((const unsigned char *) inode->i_block, EXT2_INLINE_DATA_SIZE,
+            path, path_len);
+        return;
+    }
+
+    // 12 direct blocks, then single, double and triple indirect
+    unsigned int i;
+    for (i = 0; i < 15; i++){
+        walk_blocks(dir_ino, inode->i_block[i], i < 12 ? 0 : i - 11, path, path_len);
+    }
+}
+
+int main(int argc, char **argv) {
+    stats_init(&argc, argv);
+
+    if (argc == 4 && strcmp(argv[1], "-c") == 0) {
+        csv = 1;
+        argv++;
+    } else if (argc != 3) {
+        fprintf(stderr, "Usage: ext2_dump [-c] <image file name> <output file>\n");
+        exit(1);
+    }
+
+    if (disk_init(argv[1]) == -1) {
+        return ENOENT;
+    }
+
+    out = fopen(argv[2], "w");
+    if (out == NULL) {
+        perror(argv[2]);
+        exit(1);
+    }
+
+    visited = calloc((sb->s_inodes_count + 7) / 8, 1);
+    if (visited == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+    if (nthreads > get_group_count()) {
+        nthreads = get_group_count();
+    }
+    pthread_t threads[nthreads];
+    long i;
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, scan_groups, NULL) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    if (csv) {
+        fprintf(out, "path,ino,mode,links,size,blocks,atime,ctime,mtime\n");
+    } else {
+        write_or_die(DUMP_MAGIC, 8);
+    }
+
+    char path[MAX_PATH_LEN] = "/";
+    emit_row(EXT2_ROOT_INO, path, 1);
+    walk_directory(EXT2_ROOT_INO, path, 1);
+
+    // the last partial batch, then an empty one to mark the end
+    if (out_batch.rows > 0) {
+        flush_batch();
+    }
+    if (!csv) {
+        flush_batch();
+    }
+    if (fclose(out) != 0) {
+        perror(argv[2]);
+        exit(1);
+    }
+    return damaged;
+}
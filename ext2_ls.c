@@ -8,33 +8,40 @@
 #include <string.h>
 #include "ext2.h"
 #include "shared.h"
+#include "stats.h"
 
-unsigned char *disk;
+void print_entries(const unsigned char *data, unsigned int len, unsigned int print_dots){
+    struct ext2_dir_entry_2 *dir_entry;
+    const unsigned char *curr_pos = data;
 
-void print_directory(const struct ext2_inode *inode, unsigned int print_dots){
-    int i_blk_idx;
-    for (i_blk_idx = 0; i_blk_idx < 12; i_blk_idx++){
-        if (inode->i_block[i_blk_idx]){
-            struct ext2_dir_entry_2 *dir_entry;
-            unsigned char *data_block = disk + (inode->i_block[i_blk_idx] * EXT2_BLOCK_SIZE);
-            unsigned char *curr_pos = data_block;
+    while (curr_pos < (data + len)){
+        dir_entry = (struct ext2_dir_entry_2 *)curr_pos;
 
+        if (dir_entry->name_len > 0){
+            if (print_dots){
+                printf("%.*s\n", dir_entry->name_len, dir_entry->name);
+            } else if (strncmp(dir_entry->name, "..",  dir_entry->name_len) != 0) {
+                printf("%.*s\n", dir_entry->name_len, dir_entry->name);
+            }
+        }
 
-            while (curr_pos < (data_block + EXT2_BLOCK_SIZE)){
-                dir_entry = (struct ext2_dir_entry_2 *)curr_pos;
+        curr_pos += dir_entry->rec_len;
+    }
+}
 
-                if (dir_entry->name_len > 0){
-                    if (print_dots){
-                        printf("%.*s\n", dir_entry->name_len, dir_entry->name);
-                    } else if (strncmp(dir_entry->name, "..",  dir_entry->name_len) != 0) {
-                        printf("%.*s\n", dir_entry->name_len, dir_entry->name);
-                    }
-                }
+void print_directory(const struct ext2_inode *inode, unsigned int print_dots){
+    // inline directories keep their entries in i_block
+    if (inode->i_flags & EXT2_INLINE_DATA_FL){
+        print_entries((const unsigned char *) inode->i_block, EXT2_INLINE_DATA_SIZE, print_dots);
+        return;
+    }
 
-                curr_pos += dir_entry->rec_len;
-            }
+    int i_blk_idx;
+    for (i_blk_idx = 0; i_blk_idx < 12; i_blk_idx++){
+        if (inode->i_block[i_blk_idx]){
+            unsigned char *data_block = disk + (inode->i_block[i_blk_idx] * block_size);
+            print_entries(data_block, block_size, print_dots);
         }
-
     }
 }
 
@@ -59,6 +66,8 @@ void print_file_name(char *disk_path){
 }
 
 int main(int argc, char **argv) {
+    stats_init(&argc, argv);
+
     unsigned int inode_idx, path_arg_id, print_dots = 0;
 
     if (argc != 3 && argc != 4) {
@@ -98,7 +107,7 @@ int main(int argc, char **argv) {
         struct ext2_inode *inode = get_inode_by_idx(inode_idx);
         if (inode){
             // check whether the inode is a dir or file
-            if (inode->i_mode & EXT2_S_IFDIR){
+            if ((inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR){
                 print_directory(inode, print_dots);
             } else {
                 print_file_name(argv[path_arg_id]);
@@ -8,54 +8,136 @@
 #include <string.h>
 #include "ext2.h"
 #include "shared.h"
+#include "stats.h"
 
-unsigned char *disk;
+// Append the entry to the records packed into len bytes by splitting the
+// last record. Returns 0 if there is not enough room left.
+int insert_entry_in_buf(unsigned char *buf, unsigned int len,
+    struct ext2_dir_entry_2 dir_entry, char *dir_entry_name){
 
-void link_entry_to_inode(struct ext2_dir_entry_2 dir_entry, struct ext2_inode *inode,
+    unsigned char *curr = buf;
+    unsigned char *end = buf + len;
+    unsigned int needed = EXT2_DIR_REC_LEN(dir_entry.name_len);
+
+    struct ext2_dir_entry_2 *curr_dir_entry;
+    while (curr < end) {
+        curr_dir_entry = (struct ext2_dir_entry_2 *)curr;
+
+        if (curr + curr_dir_entry->rec_len >= end) {
+            unsigned int actual_size = EXT2_DIR_REC_LEN(curr_dir_entry->name_len);
+            if (actual_size + needed > curr_dir_entry->rec_len) {
+                return 0;
+            }
+
+            dir_entry.rec_len = curr_dir_entry->rec_len - actual_size;
+            curr_dir_entry->rec_len = actual_size;
+            curr += actual_size;
+            memcpy(curr + sizeof(struct ext2_dir_entry_2), dir_entry_name, dir_entry.name_len);
+            (*(struct ext2_dir_entry_2 *) curr) = dir_entry;
+            return 1;
+        }
+        curr += curr_dir_entry->rec_len;
+    }
+    return 0;
+}
+
+// Lay out "." and ".." inside i_block of a new inline directory
+void init_inline_dir(struct ext2_inode *inode, unsigned int inode_idx,
+    unsigned int parent_inode_idx){
+
+    unsigned char *data = (unsigned char *) inode->i_block;
+    struct ext2_dir_entry_2 *curr_dir = (struct ext2_dir_entry_2 *) data;
+    struct ext2_dir_entry_2 *prev_dir = (struct ext2_dir_entry_2 *)(data + EXT2_DIR_REC_LEN(1));
+
+    curr_dir->inode = inode_idx;
+    curr_dir->rec_len = EXT2_DIR_REC_LEN(1);
+    curr_dir->name_len = 1;
+    curr_dir->file_type = EXT2_FT_DIR;
+    memcpy(curr_dir->name, ".", 1);
+
+    prev_dir->inode = parent_inode_idx;
+    prev_dir->rec_len = EXT2_INLINE_DATA_SIZE - EXT2_DIR_REC_LEN(1);
+    prev_dir->name_len = 2;
+    prev_dir->file_type = EXT2_FT_DIR;
+    memcpy(prev_dir->name, "..", 2);
+
+    inode->i_flags |= EXT2_INLINE_DATA_FL;
+    inode->i_size = EXT2_INLINE_DATA_SIZE;
+    inode->i_blocks = 0;
+}
+
+// Move the records of a full inline directory out into a data block.
+// Returns 0 if no block could be allocated.
+int spill_inline_dir(struct ext2_inode *inode){
+    unsigned int block_idx = create_block();
+    if (block_idx == 0) {
+        return 0;
+    }
+
+    unsigned char *block = disk + block_idx * block_size;
+    memcpy(block, inode->i_block, EXT2_INLINE_DATA_SIZE);
+    memset(block + EXT2_INLINE_DATA_SIZE, 0, block_size - EXT2_INLINE_DATA_SIZE);
+
+    // stretch the last record over the rest of the block
+    unsigned char *curr = block;
+    struct ext2_dir_entry_2 *curr_dir_entry = (struct ext2_dir_entry_2 *) curr;
+    while (curr + curr_dir_entry->rec_len < block + EXT2_INLINE_DATA_SIZE) {
+        curr += curr_dir_entry->rec_len;
+        curr_dir_entry = (struct ext2_dir_entry_2 *) curr;
+    }
+    curr_dir_entry->rec_len += block_size - EXT2_INLINE_DATA_SIZE;
+
+    memset(inode->i_block, 0, sizeof(inode->i_block));
+    inode->i_block[0] = block_idx;
+    inode->i_flags &= ~EXT2_INLINE_DATA_FL;
+    inode->i_size = block_size;
+    inode->i_blocks = block_size / 512;
+    return 1;
+}
+
+// Add the entry to the directory, allocating a block if it is full.
+// Returns 0 if no block could be allocated.
+int link_entry_to_inode(struct ext2_dir_entry_2 dir_entry, struct ext2_inode *inode,
     char *dir_entry_name){
 
+    if (inode->i_flags & EXT2_INLINE_DATA_FL) {
+        if (insert_entry_in_buf((unsigned char *) inode->i_block, EXT2_INLINE_DATA_SIZE,
+                dir_entry, dir_entry_name)) {
+            return 1;
+        }
+        if (!spill_inline_dir(inode)) {
+            return 0;
+        }
+    }
+
     unsigned int i;
     for (i = 0; i < 12; i++){
         if (inode->i_block[i]){
-            unsigned char *curr = disk + (inode->i_block[i] * EXT2_BLOCK_SIZE);
-            unsigned char *end = (curr + EXT2_BLOCK_SIZE);
-
-            struct ext2_dir_entry *curr_dir_entry;
-            while (curr < end) {
-                curr_dir_entry = (struct ext2_dir_entry *)curr;
-
-                if (curr + curr_dir_entry->rec_len >= end) {
-                    int actual_size = sizeof(struct ext2_dir_entry_2)
-                        + curr_dir_entry->name_len;
-
-                    if (curr + actual_size + sizeof(struct ext2_dir_entry_2) < end){
-                        curr_dir_entry->rec_len = actual_size;
-                        curr += actual_size;
-                        break;
-                    }
-                }
-                curr += curr_dir_entry->rec_len;
-            }
-
-            if (curr != end){
-                dir_entry.rec_len = end - curr;
-                memcpy(curr + sizeof(struct ext2_dir_entry_2), dir_entry_name, dir_entry.name_len);
-                (*(struct ext2_dir_entry_2 *) curr) = dir_entry;
-            } else {
+            unsigned char *curr = disk + (inode->i_block[i] * block_size);
+            if (!insert_entry_in_buf(curr, block_size, dir_entry, dir_entry_name)){
                 continue;
             }
         } else {
-            inode->i_block[i] = create_block();
-            dir_entry.rec_len = EXT2_BLOCK_SIZE;
-            unsigned char *curr = disk + (inode->i_block[i] * EXT2_BLOCK_SIZE);
+            unsigned int block_idx = create_block();
+            if (block_idx == 0) {
+                return 0;
+            }
+            inode->i_block[i] = block_idx;
+            inode->i_size += block_size;
+            inode->i_blocks += block_size / 512;
+            dir_entry.rec_len = block_size;
+            unsigned char *curr = disk + (inode->i_block[i] * block_size);
             memcpy(curr + sizeof(struct ext2_dir_entry_2), dir_entry_name, dir_entry.name_len);
             (*(struct ext2_dir_entry_2 *) curr) = dir_entry;
         }
-        break;
+        return 1;
     }
+    return 0;
 }
 
 int main(int argc, char **argv) {
+    stats_init(&argc, argv);
+
     if (argc != 3) {
         fprintf(stderr, "Usage: ext2_mkdir <image file name> <absolute path of directory>\n");
         exit(1);
@@ -110,7 +192,7 @@ int main(int argc, char **argv) {
 
     if (parent_inode_idx){
         parent_inode = get_inode_by_idx(parent_inode_idx);
-        if (parent_inode && !(parent_inode->i_mode & EXT2_S_IFDIR)){
+        if (parent_inode && (parent_inode->i_mode & EXT2_S_IFMT) != EXT2_S_IFDIR){
             // the parent inode is not a dir
             printf("The parent is not a directory\n");
             return ENOENT;
@@ -126,26 +208,29 @@ int main(int argc, char **argv) {
 
     // create a new inode for the new dir entry
     unsigned int dir_inode_idx = create_inode();
-    if (dir_inode_idx > 2){
-        struct ext2_inode *dir_inode = get_inode_by_idx(dir_inode_idx);
-        dir_inode->i_mode = EXT2_S_IFDIR;
-        dir_inode->i_size = EXT2_BLOCK_SIZE;
-        dir_inode->i_links_count = 1;
-        dir_inode->i_blocks = 2;
-
-        int i;
-        for (i = 0; i < 15; ++i){
-            dir_inode->i_block[i] = 0;
-        }
-
-        // create a new entry for the new dir entry
-        struct ext2_dir_entry_2 dir_entry;
-        dir_entry.inode = dir_inode_idx;
-        dir_entry.name_len = strlen(dir_name);
-        dir_entry.file_type = EXT2_FT_DIR;
+    if (dir_inode_idx == 0){
+        printf("No space left on device\n");
+        return ENOSPC;
+    }
+    struct ext2_inode *dir_inode = get_inode_by_idx(dir_inode_idx);
+    dir_inode->i_mode = EXT2_S_IFDIR;
+    dir_inode->i_size = 0;
+    dir_inode->i_links_count = 1;
+    dir_inode->i_blocks = 0;
+    dir_inode->i_flags = 0;
 
-        link_entry_to_inode(dir_entry, parent_inode, dir_name);
+    int i;
+    for (i = 0; i < 15; ++i){
+        dir_inode->i_block[i] = 0;
+    }
 
+    // fill in the new dir before its parent points at it, so that running
+    // out of space only has to give back the new inode and its block
+    int linked = 1;
+    // with inline_data the new dir needs no block until it fills up
+    if (sb->s_feature_incompat & EXT2_FEATURE_INCOMPAT_INLINE_DATA){
+        init_inline_dir(dir_inode, dir_inode_idx, parent_inode_idx);
+    } else {
         struct ext2_dir_entry_2 curr_dir, prev_dir;
         curr_dir.inode = dir_inode_idx;
         curr_dir.name_len = 1;
@@ -154,9 +239,28 @@ int main(int argc, char **argv) {
         prev_dir.name_len = 2;
         prev_dir.file_type = EXT2_FT_DIR;
 
-        link_entry_to_inode(curr_dir, dir_inode, ".");
-        link_entry_to_inode(prev_dir, dir_inode, "..");
+        linked = link_entry_to_inode(curr_dir, dir_inode, ".") &&
+            link_entry_to_inode(prev_dir, dir_inode, "..");
+    }
+
+    // create a new entry for the new dir entry
+    if (linked){
+        struct ext2_dir_entry_2 dir_entry;
+        dir_entry.inode = dir_inode_idx;
+        dir_entry.name_len = strlen(dir_name);
+        dir_entry.file_type = EXT2_FT_DIR;
+
+        linked = link_entry_to_inode(dir_entry, parent_inode, dir_name);
+    }
 
+    if (!linked){
+        if (!(dir_inode->i_flags & EXT2_INLINE_DATA_FL) && dir_inode->i_block[0]){
+            free_block(dir_inode->i_block[0]);
+        }
+        memset(dir_inode, 0, sizeof(struct ext2_inode));
+        free_inode(dir_inode_idx);
+        printf("No space left on device\n");
+        return ENOSPC;
     }
 
     return 0;
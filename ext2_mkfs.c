@@ -0,0 +1,426 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "ext2.h"
+
+#define BLOCKS_PER_GROUP (8 * EXT2_BLOCK_SIZE)
+#define INODES_PER_BLOCK (EXT2_BLOCK_SIZE / sizeof(struct ext2_inode))
+#define BLOCKS_PER_INODE 4     // one inode for every 4 KiB of disk
+#define MIN_DATA_BLOCKS  50    // a trailing group smaller than this is dropped
+#define LOST_FOUND_INO   EXT2_GOOD_OLD_FIRST_INO
+
+/*
+ * Layout of the whole disk, computed up front so that every group can be
+ * written independently of the others.
+ */
+struct layout {
+    int fd;
+    unsigned int blocks_count;
+    unsigned int first_data_block;
+    unsigned int groups;
+    unsigned int gdt_blocks;
+    unsigned int inodes_per_group;
+    unsigned int itable_blocks;
+    struct ext2_super_block sb;
+    struct ext2_group_desc *gdt;
+    unsigned int next_group;   // next group for a worker to pick up
+    int error;                 // errno of the first failed write
+};
+
+// Groups 0, 1 and powers of 3, 5 and 7 carry superblock/GDT backups
+static int group_has_super(unsigned int group){
+    unsigned int base[3] = {3, 5, 7};
+    int i;
+
+    if (group <= 1){
+        return 1;
+    }
+    for (i = 0; i < 3; i++){
+        unsigned long long n = base[i];
+        while (n < group){
+            n *= base[i];
+        }
+        if (n == group){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static unsigned int group_start(const struct layout *l, unsigned int group){
+    return l->first_data_block + group * BLOCKS_PER_GROUP;
+}
+
+static unsigned int group_len(const struct layout *l, unsigned int group){
+    unsigned int len = l->blocks_count - group_start(l, group);
+    return len > BLOCKS_PER_GROUP ? BLOCKS_PER_GROUP : len;
+}
+
+// Blocks taken by superblock, GDT, bitmaps and inode table of a group
+static unsigned int group_overhead(const struct layout *l, unsigned int group){
+    unsigned int overhead = 2 + l->itable_blocks;
+    if (group_has_super(group)){
+        overhead += 1 + l->gdt_blocks;
+    }
+    return overhead;
+}
+
+static int write_blocks(int fd, const void *buf, unsigned int count, unsigned int block){
+    size_t len = (size_t) count * EXT2_BLOCK_SIZE;
+    off_t off = (off_t) block * EXT2_BLOCK_SIZE;
+
+    while (len > 0){
+        ssize_t n = pwrite(fd, buf, len, off);
+        if (n < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            return errno;
+        }
+        buf = (const char *) buf + n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+static void set_bits(unsigned char *bitmap, unsigned int from, unsigned int to){
+    unsigned int bit;
+    for (bit = from; bit < to; bit++){
+        bitmap[bit / 8] |= 1 << (bit % 8);
+    }
+}
+
+/*
+ * Fill in a group's descriptor. Group 0 also holds the root directory and
+ * lost+found, each taking one data block and one inode.
+ */
+static void init_group_desc(struct layout *l, unsigned int group){
+    struct ext2_group_desc *gd = &l->gdt[group];
+    unsigned int base = group_start(l, group);
+
+    if (group_has_super(group)){
+        base += 1 + l->gdt_blocks;
+    }
+    gd->bg_block_bitmap = base;
+    gd->bg_inode_bitmap = base + 1;
+    gd->bg_inode_table = base + 2;
+    gd->bg_free_blocks_count = group_len(l, group) - group_overhead(l, group);
+    gd->bg_free_inodes_count = l->inodes_per_group;
+
+    if (group == 0){
+        gd->bg_free_blocks_count -= 2;
+        gd->bg_free_inodes_count -= LOST_FOUND_INO;
+        gd->bg_used_dirs_count = 2;
+    }
+}
+
+// Write the bitmaps (and superblock/GDT backup) of a single group.
+// Inode tables are never written: the image starts out zeroed.
+static int write_group(struct layout *l, unsigned int group,
+    unsigned char *bitmaps, unsigned char *super){
+    struct ext2_group_desc *gd = &l->gdt[group];
+    unsigned char *block_bitmap = bitmaps;
+    unsigned char *inode_bitmap = bitmaps + EXT2_BLOCK_SIZE;
+    unsigned int used_blocks = group_overhead(l, group);
+    unsigned int start = group_start(l, group);
+    int err;
+
+    memset(bitmaps, 0, 2 * EXT2_BLOCK_SIZE);
+    if (group == 0){
+        used_blocks += 2;
+        set_bits(inode_bitmap, 0, LOST_FOUND_INO);
+    }
+    set_bits(block_bitmap, 0, used_blocks);
+    // padding past the end of the group is marked in use
+    set_bits(block_bitmap, group_len(l, group), BLOCKS_PER_GROUP);
+    set_bits(inode_bitmap, l->inodes_per_group, BLOCKS_PER_GROUP);
+
+    if ((err = write_blocks(l->fd, bitmaps, 2, gd->bg_block_bitmap))){
+        return err;
+    }
+
+    if (group_has_super(group)){
+        // the primary superblock lives at byte 1024 whatever the block size
+        struct ext2_super_block *copy = (struct ext2_super_block *) super;
+        memset(super, 0, EXT2_BLOCK_SIZE);
+        *copy = l->sb;
+        copy->s_block_group_nr = group;
+
+        if ((err = write_blocks(l->fd, super, 1, start))){
+            return err;
+        }
+        if ((err = write_blocks(l->fd, l->gdt, l->gdt_blocks, start + 1))){
+            return err;
+        }
+    }
+    return 0;
+}
+
+static void *group_worker(void *arg){
+    struct layout *l = arg;
+    unsigned char *bitmaps = malloc(2 * EXT2_BLOCK_SIZE);
+    unsigned char *super = malloc(EXT2_BLOCK_SIZE);
+
+    if (bitmaps == NULL || super == NULL){
+        __atomic_store_n(&l->error, ENOMEM, __ATOMIC_RELAXED);
+    } else {
+        unsigned int group;
+        while ((group = __atomic_fetch_add(&l->next_group, 1, __ATOMIC_RELAXED)) < l->groups){
+            int err = write_group(l, group, bitmaps, super);
+            if (err){
+                __atomic_store_n(&l->error, err, __ATOMIC_RELAXED);
+                break;
+            }
+        }
+    }
+
+    free(bitmaps);
+    free(super);
+    return NULL;
+}
+
+static void put_dir_entry(unsigned char *block, unsigned int offset, unsigned int inode,
+    unsigned short rec_len, const char *name){
+    struct ext2_dir_entry_2 *dir_entry = (struct ext2_dir_entry_2 *)(block + offset);
+    dir_entry->inode = inode;
+    dir_entry->rec_len = rec_len;
+    dir_entry->name_len = strlen(name);
+    dir_entry->file_type = EXT2_FT_DIR;
+    memcpy(dir_entry->name, name, dir_entry->name_len);
+}
+
+// Write the root directory and lost+found into group 0
+static int write_root(struct layout *l){
+    struct ext2_inode inodes[LOST_FOUND_INO];
+    unsigned char block[2][EXT2_BLOCK_SIZE];
+    unsigned int root_block = group_start(l, 0) + group_overhead(l, 0);
+    unsigned int now = time(NULL);
+    int err;
+
+    memset(inodes, 0, sizeof(inodes));
+    memset(block, 0, sizeof(block));
+
+    struct ext2_inode *root = &inodes[EXT2_ROOT_INO - 1];
+    root->i_mode = EXT2_S_IFDIR | 0755;
+    root->i_links_count = 3;
+    root->i_block[0] = root_block;
+
+    struct ext2_inode *lost_found = &inodes[LOST_FOUND_INO - 1];
+    lost_found->i_mode = EXT2_S_IFDIR | 0700;
+    lost_found->i_links_count = 2;
+    lost_found->i_block[0] = root_block + 1;
+
+    struct ext2_inode *dirs[2] = {root, lost_found};
+    int i;
+    for (i = 0; i < 2; i++){
+        dirs[i]->i_size = EXT2_BLOCK_SIZE;
+        dirs[i]->i_blocks = EXT2_BLOCK_SIZE / 512;
+        dirs[i]->i_atime = dirs[i]->i_ctime = dirs[i]->i_mtime = now;
+    }
+
+    put_dir_entry(block[0], 0, EXT2_ROOT_INO, 12, ".");
+    put_dir_entry(block[0], 12, EXT2_ROOT_INO, 12, "..");
+    put_dir_entry(block[0], 24, LOST_FOUND_INO, EXT2_BLOCK_SIZE - 24, "lost+found");
+    put_dir_entry(block[1], 0, LOST_FOUND_INO, 12, ".");
+    put_dir_entry(block[1], 12, EXT2_ROOT_INO, EXT2_BLOCK_SIZE - 12, "..");
+
+    if ((err = write_blocks(l->fd, block, 2, root_block))){
+        return err;
+    }
+    // the first inode table block is rewritten in full; the rest stays zero
+    unsigned char itable[2 * EXT2_BLOCK_SIZE];
+    memset(itable, 0, sizeof(itable));
+    memcpy(itable, inodes, sizeof(inodes));
+    return write_blocks(l->fd, itable, (sizeof(inodes) + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE,
+        l->gdt[0].bg_inode_table);
+}
+
+static void init_super(struct layout *l){
+    struct ext2_super_block *sb = &l->sb;
+    unsigned int now = time(NULL);
+    unsigned int g;
+
+    memset(sb, 0, sizeof(*sb));
+    sb->s_inodes_count = l->inodes_per_group * l->groups;
+    sb->s_blocks_count = l->blocks_count;
+    sb->s_r_blocks_count = l->blocks_count / 20;
+    sb->s_first_data_block = l->first_data_block;
+    sb->s_log_block_size = 0;   // 1024 << 0
+    sb->s_log_frag_size = 0;
+    sb->s_blocks_per_group = BLOCKS_PER_GROUP;
+    sb->s_frags_per_group = BLOCKS_PER_GROUP;
+    sb->s_inodes_per_group = l->inodes_per_group;
+    sb->s_wtime = now;
+    sb->s_lastcheck = now;
+    sb->s_max_mnt_count = 0xFFFF;
+    sb->s_magic = EXT2_SUPER_MAGIC;
+    sb->s_state = EXT2_VALID_FS;
+    sb->s_errors = EXT2_ERRORS_CONTINUE;
+    sb->s_rev_level = EXT2_DYNAMIC_REV;
+    sb->s_first_ino = EXT2_GOOD_OLD_FIRST_INO;
+    sb->s_inode_size = sizeof(struct ext2_inode);
+    sb->s_feature_incompat = EXT2_FEATURE_INCOMPAT_FILETYPE;
+    sb->s_feature_ro_compat = EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER;
+
+    for (g = 0; g < l->groups; g++){
+        sb->s_free_blocks_count += l->gdt[g].bg_free_blocks_count;
+        sb->s_free_inodes_count += l->gdt[g].bg_free_inodes_count;
+    }
+
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd < 0 || read(fd, sb->s_uuid, sizeof(sb->s_uuid)) != sizeof(sb->s_uuid)){
+        memcpy(sb->s_uuid, &now, sizeof(now));
+    }
+    if (fd >= 0){
+        close(fd);
+    }
+}
+
+// Work out group count and sizes for an image of blocks_count blocks
+static int init_layout(struct layout *l, unsigned long long blocks_count){
+    l->first_data_block = 1;
+    if (blocks_count > 0xFFFFFFFFULL){
+        blocks_count = 0xFFFFFFFFULL;
+    }
+    l->blocks_count = blocks_count;
+    if (l->blocks_count <= l->first_data_block){
+        return -1;
+    }
+
+    l->groups = (l->blocks_count - l->first_data_block + BLOCKS_PER_GROUP - 1) / BLOCKS_PER_GROUP;
+    l->gdt_blocks = (l->groups * sizeof(struct ext2_group_desc) + EXT2_BLOCK_SIZE - 1)
+        / EXT2_BLOCK_SIZE;
+
+    unsigned int inodes = l->blocks_count / BLOCKS_PER_INODE;
+    unsigned int ipg = (inodes + l->groups - 1) / l->groups;
+    ipg = (ipg + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK * INODES_PER_BLOCK;
+    if (ipg < 2 * INODES_PER_BLOCK){
+        ipg = 2 * INODES_PER_BLOCK;
+    }
+    if (ipg > BLOCKS_PER_GROUP){
+        ipg = BLOCKS_PER_GROUP;
+    }
+    l->inodes_per_group = ipg;
+    l->itable_blocks = ipg / INODES_PER_BLOCK;
+
+    // drop a trailing group too small to hold its own metadata
+    unsigned int last = l->groups - 1;
+    if (l->groups > 1 && group_len(l, last) < group_overhead(l, last) + MIN_DATA_BLOCKS){
+        l->blocks_count = group_start(l, last);
+        l->groups--;
+    }
+    if (group_len(l, 0) < group_overhead(l, 0) + 2){
+        return -1;
+    }
+    return 0;
+}
+
+// Parse a size such as 128K, 64M or 2G into bytes
+static unsigned long long parse_size(const char *arg){
+    char *end;
+    unsigned long long size = strtoull(arg, &end, 10);
+
+    switch (*end){
+        case 'G': case 'g': size <<= 10; /* fall through */
+        case 'M': case 'm': size <<= 10; /* fall through */
+        case 'K': case 'k': size <<= 10; end++; break;
+        case '\0': break;
+        default: return 0;
+    }
+    return *end == '\0' ? size : 0;
+}
+
+int main(int argc, char **argv) {
+    unsigned int incompat = 0;
+
+    if (argc == 5 && strcmp(argv[1], "-O") == 0 && strcmp(argv[2], "inline_data") == 0) {
+        incompat |= EXT2_FEATURE_INCOMPAT_INLINE_DATA;
+        argv += 2;
+    } else if (argc != 3) {
+        fprintf(stderr, "Usage: ext2_mkfs [-O inline_data] <image file name> <size[K|M|G]>\n");
+        exit(1);
+    }
+
+    unsigned long long size = parse_size(argv[2]);
+    struct layout l;
+    memset(&l, 0, sizeof(l));
+    if (size == 0 || init_layout(&l, size / EXT2_BLOCK_SIZE) == -1) {
+        fprintf(stderr, "ext2_mkfs: invalid image size %s\n", argv[2]);
+        return EINVAL;
+    }
+
+    l.fd = open(argv[1], O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (l.fd < 0) {
+        perror(argv[1]);
+        exit(1);
+    }
+
+    // Reserve the space up front; a freshly truncated file reads back as
+    // zeros either way, so inode tables and data blocks are never written.
+    off_t image_size = (off_t) l.blocks_count * EXT2_BLOCK_SIZE;
+    if (fallocate(l.fd, 0, 0, image_size) == -1) {
+        if (errno != EOPNOTSUPP && errno != ENOSYS) {
+            perror("fallocate");
+            exit(1);
+        }
+        if (ftruncate(l.fd, image_size) == -1) {
+            perror("ftruncate");
+            exit(1);
+        }
+    }
+
+    l.gdt = calloc(l.gdt_blocks, EXT2_BLOCK_SIZE);
+    if (l.gdt == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    unsigned int g;
+    for (g = 0; g < l.groups; g++) {
+        init_group_desc(&l, g);
+    }
+    init_super(&l);
+    l.sb.s_feature_incompat |= incompat;
+
+    // every group is independent now, hand them out to a pool of workers
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+    if (nthreads > l.groups) {
+        nthreads = l.groups;
+    }
+    pthread_t threads[nthreads];
+    long i;
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, group_worker, &l) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    if (l.error == 0) {
+        l.error = write_root(&l);
+    }
+    if (l.error != 0 || fsync(l.fd) == -1) {
+        fprintf(stderr, "ext2_mkfs: %s: %s\n", argv[1], strerror(l.error ? l.error : errno));
+        exit(1);
+    }
+    close(l.fd);
+    free(l.gdt);
+
+    printf("Blocks: %u, Inodes: %u, Groups: %u\n", l.sb.s_blocks_count,
+        l.sb.s_inodes_count, l.groups);
+    return 0;
+}
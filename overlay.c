@@ -0,0 +1,336 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <string.h>
+#include <errno.h>
+#include "overlay.h"
+#include "blockio.h"
+
+// /proc/self/pagemap entry bits, see Documentation/admin-guide/mm/pagemap.rst
+#define PM_PRESENT    (1ULL << 63)
+#define PM_SWAPPED    (1ULL << 62)
+#define PM_FILE       (1ULL << 61)
+#define PAGEMAP_BATCH 4096
+
+static int overlay_fd = -1;
+static struct overlay_header header;
+static unsigned int *remap;           // block -> delta slot, 0 if unchanged
+static unsigned char *image;          // private copy the tools work on
+static const unsigned char *base;     // read-only view of the base image
+
+static off_t table_size(unsigned int block_count){
+  off_t len = (off_t) block_count * sizeof(unsigned int);
+  return (len + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE * EXT2_BLOCK_SIZE;
+}
+
+static off_t slot_offset(unsigned int slot){
+  return EXT2_BLOCK_SIZE + table_size(header.block_count)
+    + (off_t)(slot - 1) * EXT2_BLOCK_SIZE;
+}
+
+static void get_base_id(const struct stat *st, struct overlay_base_id *id){
+  memset(id, 0, sizeof(*id));
+  id->dev = st->st_dev;
+  id->ino = st->st_ino;
+  id->mtime_sec = st->st_mtim.tv_sec;
+  id->mtime_nsec = st->st_mtim.tv_nsec;
+  id->ctime_sec = st->st_ctim.tv_sec;
+  id->ctime_nsec = st->st_ctim.tv_nsec;
+}
+
+int overlay_detect(int fd){
+  char magic[sizeof(header.magic)];
+  return pread(fd, magic, sizeof(magic), 0) == sizeof(magic)
+    && memcmp(magic, OVERLAY_MAGIC, sizeof(magic)) == 0;
+}
+
+/*
+ * Pages of the private mapping that have been written to are no longer
+ * backed by the base file. Read their flags from /proc/self/pagemap and
+ * mark the blocks they hold as candidates, so a run that changed little
+ * costs little. Returns -1 if pagemap is unavailable.
+ */
+static int find_written_blocks(unsigned char *candidates){
+  long page_size = sysconf(_SC_PAGESIZE);
+  unsigned int blocks_per_page = page_size / EXT2_BLOCK_SIZE;
+  size_t pages = ((size_t) header.block_count + blocks_per_page - 1) / blocks_per_page;
+  unsigned long long entries[PAGEMAP_BATCH];
+  size_t page, i;
+
+  int fd = open("/proc/self/pagemap", O_RDONLY);
+  if (fd == -1){
+    return -1;
+  }
+  off_t first = (off_t)((unsigned long) image / page_size) * sizeof(entries[0]);
+  for (page = 0; page < pages; page += PAGEMAP_BATCH){
+    size_t n = pages - page < PAGEMAP_BATCH ? pages - page : PAGEMAP_BATCH;
+    ssize_t len = n * sizeof(entries[0]);
+    if (pread(fd, entries, len, first + page * sizeof(entries[0])) != len){
+      close(fd);
+      return -1;
+    }
+    for (i = 0; i < n; i++){
+      // present or swapped, and no longer the file's page
+      if ((entries[i] & (PM_PRESENT | PM_SWAPPED)) && !(entries[i] & PM_FILE)){
+        unsigned int block = (page + i) * blocks_per_page, b;
+        for (b = block; b < block + blocks_per_page && b < header.block_count; b++){
+          candidates[b / 8] |= 1 << (b % 8);
+        }
+      }
+    }
+  }
+  close(fd);
+  return 0;
+}
+
+static void add_req(struct blockio_req **reqs, unsigned int *count, unsigned int *cap,
+    int write, void *buf, size_t len, off_t off){
+  if (*count == *cap){
+    *cap = *cap ? 2 * *cap : BLOCKIO_DEPTH;
+    *reqs = realloc(*reqs, *cap * sizeof(struct blockio_req));
+    if (*reqs == NULL){
+      perror("overlay: realloc");
+      exit(1);
+    }
+  }
+  struct blockio_req *req = &(*reqs)[(*count)++];
+  req->fd = overlay_fd;
+  req->write = write;
+  req->buf = buf;
+  req->len = len;
+  req->off = off;
+}
+
+// Write the blocks changed by this run into the delta, then the parts of
+// the remap table that point at new slots, then the header
+static void overlay_sync(){
+  size_t bitmap_len = (header.block_count + 7) / 8;
+  unsigned int table_blocks = table_size(header.block_count) / EXT2_BLOCK_SIZE;
+  unsigned char *candidates = calloc(bitmap_len, 1);
+  unsigned char *table_dirty = calloc((table_blocks + 7) / 8, 1);
+  unsigned int old_slot_count = header.slot_count;
+  if (candidates == NULL || table_dirty == NULL){
+    perror("overlay: calloc");
+    exit(1);
+  }
+  if (find_written_blocks(candidates) == -1){
+    memset(candidates, 0xff, bitmap_len);
+  }
+
+  // the delta as it is on disk, to tell rewritten blocks from changed ones
+  size_t delta_len = slot_offset(old_slot_count + 1);
+  const unsigned char *delta = MAP_FAILED;
+  if (old_slot_count){
+    delta = mmap(NULL, delta_len, PROT_READ, MAP_SHARED, overlay_fd, 0);
+  }
+
+  struct blockio_req *reqs = NULL;
+  unsigned int block, count = 0, cap = 0;
+  for (block = 0; block < header.block_count; block++){
+    if (candidates[block / 8] == 0){
+      block |= 7;
+      continue;
+    }
+    if (!(candidates[block / 8] & (1 << (block % 8)))){
+      continue;
+    }
+    unsigned char *data = image + (size_t) block * EXT2_BLOCK_SIZE;
+
+    if (remap[block] == 0){
+      if (memcmp(data, base + (size_t) block * EXT2_BLOCK_SIZE, EXT2_BLOCK_SIZE) == 0){
+        continue;
+      }
+      remap[block] = ++header.slot_count;
+      unsigned int table_block = block / (EXT2_BLOCK_SIZE / sizeof(unsigned int));
+      table_dirty[table_block / 8] |= 1 << (table_block % 8);
+    } else if (delta != MAP_FAILED &&
+        memcmp(data, delta + slot_offset(remap[block]), EXT2_BLOCK_SIZE) == 0){
+      continue;
+    }
+    add_req(&reqs, &count, &cap, 1, data, EXT2_BLOCK_SIZE, slot_offset(remap[block]));
+  }
+  if (delta != MAP_FAILED){
+    munmap((void *) delta, delta_len);
+  }
+  free(candidates);
+
+  // the data goes out before the table and header that point at it
+  int err = blockio_run(reqs, count);
+  count = 0;
+  if (err == 0){
+    unsigned int t;
+    size_t table_len = (size_t) header.block_count * sizeof(unsigned int);
+    for (t = 0; t < table_blocks; t++){
+      if (table_dirty[t / 8] & (1 << (t % 8))){
+        size_t start = (size_t) t * EXT2_BLOCK_SIZE;
+        size_t len = table_len - start < EXT2_BLOCK_SIZE ? table_len - start : EXT2_BLOCK_SIZE;
+        add_req(&reqs, &count, &cap, 1, (unsigned char *) remap + start, len,
+          EXT2_BLOCK_SIZE + start);
+      }
+    }
+    err = blockio_run(reqs, count);
+  }
+  free(reqs);
+  free(table_dirty);
+  if (err ||
+      (header.slot_count != old_slot_count &&
+       pwrite(overlay_fd, &header, sizeof(header), 0) != sizeof(header))){
+    fprintf(stderr, "overlay: write: %s\n", strerror(err ? err : errno));
+    exit(1);
+  }
+}
+
+unsigned char *overlay_open(int fd, size_t *size){
+  if (pread(fd, &header, sizeof(header), 0) != sizeof(header)){
+    perror("overlay: pread");
+    return NULL;
+  }
+  header.base_path[sizeof(header.base_path) - 1] = '\0';
+
+  int base_fd = open(header.base_path, O_RDONLY);
+  struct stat st;
+  if (base_fd == -1 || fstat(base_fd, &st) == -1){
+    perror(header.base_path);
+    return NULL;
+  }
+  // a delta applied to a different base would silently mix old and new blocks
+  struct overlay_base_id id;
+  get_base_id(&st, &id);
+  if (st.st_size != (off_t) header.block_count * EXT2_BLOCK_SIZE ||
+      memcmp(&id, &header.base_id, sizeof(id)) != 0){
+    fprintf(stderr, "overlay: base image %s has changed since the clone was made\n",
+      header.base_path);
+    close(base_fd);
+    return NULL;
+  }
+
+  *size = st.st_size;
+  // only the pages a tool writes to need memory, so don't reserve the rest
+  image = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_NORESERVE,
+    base_fd, 0);
+  base = mmap(NULL, *size, PROT_READ, MAP_SHARED, base_fd, 0);
+  close(base_fd);
+  if (image == MAP_FAILED || base == MAP_FAILED){
+    perror("overlay: mmap");
+    return NULL;
+  }
+
+  // unchanged stretches of the table are still holes in the overlay file;
+  // only read what has data and leave the rest zero
+  remap = calloc(header.block_count, sizeof(unsigned int));
+  struct blockio_req *reqs = malloc((header.slot_count + 1) * sizeof(struct blockio_req));
+  unsigned int block, count = 0;
+  if (remap == NULL || reqs == NULL){
+    perror("overlay: malloc");
+    return NULL;
+  }
+  off_t table_start = EXT2_BLOCK_SIZE;
+  off_t table_end = table_start + (off_t) header.block_count * sizeof(unsigned int);
+  off_t data = table_start;
+  while (data < table_end){
+    off_t hole = table_end;
+    data = lseek(fd, data, SEEK_DATA);
+    if (data == -1 && errno == ENXIO){
+      break;
+    }
+    if (data == -1){ // no SEEK_DATA here, read the whole table
+      data = table_start;
+    } else {
+      hole = lseek(fd, data, SEEK_HOLE);
+      if (hole == -1 || hole > table_end){
+        hole = table_end;
+      }
+    }
+    if (data >= table_end){
+      break;
+    }
+
+    unsigned char *dst = (unsigned char *) remap + (data - table_start);
+    ssize_t len = hole - data;
+    if (pread(fd, dst, len, data) != len){
+      perror("overlay: pread");
+      return NULL;
+    }
+
+    // apply the delta on top of the private mapping
+    unsigned int last = (hole - table_start) / sizeof(unsigned int);
+    for (block = (data - table_start) / sizeof(unsigned int); block < last; block++){
+      if (remap[block] && count < header.slot_count){
+        struct blockio_req *req = &reqs[count++];
+        req->fd = fd;
+        req->write = 0;
+        req->buf = image + (size_t) block * EXT2_BLOCK_SIZE;
+        req->len = EXT2_BLOCK_SIZE;
+        req->off = slot_offset(remap[block]);
+      }
+    }
+    data = hole;
+  }
+  int err = blockio_run(reqs, count);
+  free(reqs);
+  if (err){
+    fprintf(stderr, "overlay: read: %s\n", strerror(err));
+    return NULL;
+  }
+
+  overlay_fd = fd;
+  atexit(overlay_sync);
+  return image;
+}
+
+int overlay_create(const char *base_path, const char *overlay_path){
+  struct overlay_header new_header;
+  struct stat st;
+
+  memset(&new_header, 0, sizeof(new_header));
+  memcpy(new_header.magic, OVERLAY_MAGIC, sizeof(new_header.magic));
+
+  char *abs_path = realpath(base_path, NULL);
+  if (abs_path == NULL || stat(abs_path, &st) == -1){
+    perror(base_path);
+    return -1;
+  }
+  if (strlen(abs_path) >= sizeof(new_header.base_path)){
+    fprintf(stderr, "%s: path too long\n", abs_path);
+    free(abs_path);
+    return -1;
+  }
+  strcpy(new_header.base_path, abs_path);
+  free(abs_path);
+  if (st.st_size % EXT2_BLOCK_SIZE != 0){
+    fprintf(stderr, "%s: not a whole number of blocks\n", base_path);
+    return -1;
+  }
+  new_header.block_count = st.st_size / EXT2_BLOCK_SIZE;
+  get_base_id(&st, &new_header.base_id);
+
+  int base_fd = open(base_path, O_RDONLY);
+  int stacked = base_fd != -1 && overlay_detect(base_fd);
+  close(base_fd);
+  if (stacked){
+    fprintf(stderr, "%s: cannot stack an overlay on another overlay\n", base_path);
+    return -1;
+  }
+
+  int fd = open(overlay_path, O_RDWR | O_CREAT | O_EXCL, 0644);
+  if (fd == -1){
+    perror(overlay_path);
+    return -1;
+  }
+
+  // the remap table starts out as a hole, i.e. all blocks unchanged
+  if (pwrite(fd, &new_header, sizeof(new_header), 0) != sizeof(new_header) ||
+      ftruncate(fd, EXT2_BLOCK_SIZE + table_size(new_header.block_count)) == -1){
+    perror(overlay_path);
+    close(fd);
+    return -1;
+  }
+
+  close(fd);
+  return 0;
+}
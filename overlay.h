@@ -0,0 +1,51 @@
+#ifndef OVERLAY_H
+#define OVERLAY_H
+
+#include "ext2.h"
+
+/*
+ * Copy-on-write overlay images.
+ *
+ * An overlay file stands in for a full image: it names a read-only base
+ * image and stores only the blocks that differ from it. On disk it is
+ *
+ *   block 0          struct overlay_header
+ *   block 1..        remap table, one unsigned int per base block
+ *                    (0 = unchanged, n = stored in delta slot n)
+ *   after the table  delta slots, one block each, in allocation order
+ *
+ * disk_init() recognises overlays by their magic and maps the base image
+ * privately with the delta applied; modified blocks are written back to
+ * new or existing slots when the tool exits. The base must stay as it was
+ * when the overlay was made: an overlay whose base has since been modified
+ * or replaced is refused.
+ */
+
+#define OVERLAY_MAGIC "EXT2OVL2"
+
+// Enough of the base image's stat to notice it was written to or replaced
+struct overlay_base_id {
+  unsigned long long dev;
+  unsigned long long ino;
+  long long          mtime_sec, mtime_nsec;
+  long long          ctime_sec, ctime_nsec;
+};
+
+struct overlay_header {
+  char         magic[8];
+  unsigned int block_count;  // blocks in the base image
+  unsigned int slot_count;   // delta slots in use
+  struct overlay_base_id base_id;
+  char         base_path[EXT2_BLOCK_SIZE - 16 - sizeof(struct overlay_base_id)];
+};
+
+// Is the open file an overlay?
+int overlay_detect(int fd);
+
+// Map the overlay's base image with its delta applied, NULL on error
+unsigned char *overlay_open(int fd, size_t *size);
+
+// Create an empty overlay on top of base_path, -1 on error
+int overlay_create(const char *base_path, const char *overlay_path);
+
+#endif
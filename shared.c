@@ -6,15 +6,37 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include "shared.h"
+#include "stats.h"
+#include "overlay.h"
 
 unsigned char *disk;
 struct ext2_super_block *sb;
+unsigned int block_size;
 
-// Initialize the ext2 disk by the disk image path
+static int select_disk_ops();
+
+// Initialize the ext2 disk by the disk image path. The path may also name
+// an overlay made by ext2_clone, in which case its base image is mapped
+// copy-on-write and the changes go to the overlay.
 int disk_init(const char *image_path){
   int fd = open(image_path, O_RDWR);
+  struct stat st;
+  size_t size;
 
-  disk = mmap(NULL, 128 * 1024, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    perror(image_path);
+    return -1;
+  }
+
+  if (overlay_detect(fd)) {
+    disk = overlay_open(fd, &size);
+    if (disk == NULL) {
+      exit(1);
+    }
+  } else {
+    size = st.st_size;
+    disk = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
 
   if(disk == MAP_FAILED) {
     perror("mmap");
@@ -22,20 +44,148 @@ int disk_init(const char *image_path){
   }
 
   sb = (struct ext2_super_block *)(disk + 1024);
+  block_size = 1024 << sb->s_log_block_size;
+
+  if (select_disk_ops() == -1) {
+    fprintf(stderr, "%s: unsupported block size %u\n", image_path, block_size);
+    exit(1);
+  }
 
   return 0;
 }
 
-// Find the inode by inode index in the inode table
+// The group descriptor table, in the block after the superblock
+struct ext2_group_desc *get_group_desc(){
+  return (struct ext2_group_desc *)(disk + (sb->s_first_data_block + 1) * block_size);
+}
+
+// Find the inode by inode index in the inode table of its group
 struct ext2_inode *get_inode_by_idx(unsigned int inode_idx){
-  struct ext2_group_desc *gd = (struct ext2_group_desc *)(disk + 2 * EXT2_BLOCK_SIZE);
-  char *inode_table = (char *)(disk + EXT2_BLOCK_SIZE * gd->bg_inode_table);
-  int inode_size = sizeof(struct ext2_inode);
-  return (struct ext2_inode *)(inode_table + inode_size * (inode_idx - 1));
+  struct ext2_group_desc *gd = get_group_desc();
+  unsigned int group = (inode_idx - 1) / sb->s_inodes_per_group;
+  unsigned int offset = (inode_idx - 1) % sb->s_inodes_per_group;
+  char *inode_table = (char *)(disk + block_size * gd[group].bg_inode_table);
+  return (struct ext2_inode *)(inode_table + get_inode_size() * offset);
 }
 
-// Find inode index by the absolute disk path
-unsigned int get_inode_idx_by_path(const char *disk_path){
+// On-disk size of an inode, which dynamic revision images may enlarge
+unsigned int get_inode_size(){
+  if (sb->s_rev_level >= EXT2_DYNAMIC_REV && sb->s_inode_size){
+    return sb->s_inode_size;
+  }
+  return sizeof(struct ext2_inode);
+}
+
+// Force inlining so every specialized variant gets its own copy of the body
+#define ALWAYS_INLINE static inline __attribute__((always_inline))
+
+// The first 4 bytes of a name as one word, zero padded past name_len.
+// Every record has room for at least 4 name bytes, so this never reads
+// past the record even for short names.
+ALWAYS_INLINE unsigned int name_prefix(const char *name, unsigned int name_len){
+  unsigned int prefix;
+  memcpy(&prefix, name, sizeof(prefix));
+  if (name_len < sizeof(prefix)){
+    prefix &= (1U << (8 * name_len)) - 1;
+  }
+  return prefix;
+}
+
+// Find the dir_entry by name among the records packed into len bytes.
+// Records are filtered on name_len and then the 4-byte prefix word before
+// the full (vectorized) memcmp of the name.
+ALWAYS_INLINE struct ext2_dir_entry_2 *scan_entries(const unsigned char *buf,
+  const unsigned int len, const char *dir_entry_name){
+  struct ext2_dir_entry_2 *dir_entry;
+  const unsigned char *curr = buf;
+  const unsigned char *end = (buf + len);
+  size_t name_len = strlen(dir_entry_name);
+
+  if (name_len == 0 || name_len > EXT2_NAME_LEN){
+    return NULL;
+  }
+
+  char padded[sizeof(unsigned int)] = {0};
+  memcpy(padded, dir_entry_name, name_len < sizeof(padded) ? name_len : sizeof(padded));
+  unsigned int prefix = name_prefix(padded, name_len);
+
+  while (curr < end){
+    dir_entry = (struct ext2_dir_entry_2 *) curr;
+    STATS_ADD(entries_compared, 1);
+
+    if (dir_entry->name_len == name_len && dir_entry->inode != 0 &&
+        name_prefix(dir_entry->name, name_len) == prefix &&
+        memcmp(dir_entry->name, dir_entry_name, name_len) == 0){
+      return dir_entry;
+    }
+
+    if (dir_entry->rec_len == 0){ // corrupt block, don't spin on it
+      break;
+    }
+    curr += dir_entry->rec_len;
+  }
+
+  return NULL;
+}
+
+// Look the name up in one data block of a directory
+ALWAYS_INLINE struct ext2_dir_entry_2 *find_in_dir_block(unsigned int block_idx,
+  const char *dir_entry_name, const unsigned int bs){
+  STATS_ADD(blocks_touched, 1);
+  STATS_ADD(path_blocks, 1);
+  return scan_entries(disk + block_idx * bs, bs, dir_entry_name);
+}
+
+// Find the dir_entry by name inside an inode with bs sized blocks
+ALWAYS_INLINE struct ext2_dir_entry_2 *find_in_dir_inode(const struct ext2_inode *inode,
+  const char *dir_entry_name, const unsigned int bs){
+
+  struct ext2_dir_entry_2 *dir_entry;
+  const unsigned int indirect_len = bs / sizeof(unsigned int);
+
+  // small directories live in i_block itself, no block to fetch
+  if (inode->i_flags & EXT2_INLINE_DATA_FL){
+    return scan_entries((const unsigned char *) inode->i_block,
+      EXT2_INLINE_DATA_SIZE, dir_entry_name);
+  }
+
+  // go through all of the block pointers and try to find the entry
+  int i_blk_idx, blk_ptr_idx;
+  for (i_blk_idx = 0; i_blk_idx < 14; i_blk_idx++){
+    // first 12 direct block pointer
+    if (i_blk_idx < 12 && inode->i_block[i_blk_idx]){
+      dir_entry = find_in_dir_block(inode->i_block[i_blk_idx], dir_entry_name, bs);
+      if (dir_entry){
+        return dir_entry;
+      }
+    }
+
+    // one single direct block pointer
+    if (i_blk_idx == 12 && inode->i_block[i_blk_idx]){
+      unsigned int *data_blocks = (unsigned int *)(disk + (inode->i_block[i_blk_idx] * bs));
+      STATS_ADD(blocks_touched, 1);
+      STATS_ADD(path_blocks, 1);
+
+      for (blk_ptr_idx = 0; blk_ptr_idx < indirect_len; blk_ptr_idx++){
+        if (data_blocks[blk_ptr_idx] == 0){
+          continue;
+        }
+        dir_entry = find_in_dir_block(data_blocks[blk_ptr_idx], dir_entry_name, bs);
+        if (dir_entry){
+          return dir_entry;
+        }
+      }
+    }
+
+
+  }
+
+  return NULL;
+}
+
+// Walk the absolute disk path down from the root inode. With the filetype
+// feature, the dir entry alone tells whether a component is a directory.
+ALWAYS_INLINE unsigned int walk_path(const char *disk_path, const int filetype){
   if (disk_path[0] != '/'){ // abs path must start with '/'
     return -1;
   }
@@ -62,10 +212,13 @@ unsigned int get_inode_idx_by_path(const char *disk_path){
       if (dir_entry != NULL){
         inode_idx = dir_entry->inode;
 
-        if ((curr < disk_path_len) && (curr_inode->i_mode & EXT2_S_IFDIR) == 0){
-          //DEBUG MSG
-          //printf("get_inode_idx_by_path encountered a file instead of a dir.");
-          return 0;
+        // anything but the last component must be a directory
+        if (curr < disk_path_len){
+          int is_dir = filetype ? dir_entry->file_type == EXT2_FT_DIR
+            : (get_inode_by_idx(inode_idx)->i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR;
+          if (!is_dir){
+            return 0;
+          }
         }
       } else {
         return 0;
@@ -76,149 +229,219 @@ unsigned int get_inode_idx_by_path(const char *disk_path){
   return inode_idx;
 }
 
-// Find the dir_entry by name inside an inode
-struct ext2_dir_entry_2 *get_dir_entry_in_inode(const struct ext2_inode *inode,
-  const char *dir_entry_name){
-
-  struct ext2_dir_entry_2 *dir_entry;
-  unsigned int indirect_len = EXT2_BLOCK_SIZE / sizeof(unsigned int);
-
-  // go through all of the block pointers and try to find the entry
-  int i_blk_idx, blk_ptr_idx;
-  for (i_blk_idx = 0; i_blk_idx < 14; i_blk_idx++){
-    // first 12 direct block pointer
-    if (i_blk_idx < 12 && inode->i_block[i_blk_idx]){
-      unsigned char *data_block = disk + (inode->i_block[i_blk_idx] * EXT2_BLOCK_SIZE);
-      dir_entry = get_entry_in_block(data_block, dir_entry_name);
-      if (dir_entry && strncmp(dir_entry->name, dir_entry_name, dir_entry->name_len) == 0){
-        return dir_entry;
-      }
-    }
-
-    // one single direct block pointer
-    if (i_blk_idx == 12 && inode->i_block[i_blk_idx]){
-      unsigned int *data_blocks = (unsigned int *)(disk + (inode->i_block[i_blk_idx] * EXT2_BLOCK_SIZE));
-
-      for (blk_ptr_idx = 0; blk_ptr_idx < indirect_len; blk_ptr_idx++){
-        unsigned char *data_block = disk + (data_blocks[blk_ptr_idx] * EXT2_BLOCK_SIZE);
-        dir_entry = get_entry_in_block(data_block, dir_entry_name);
-        if (dir_entry && strncmp(dir_entry->name, dir_entry_name, dir_entry->name_len) == 0){
-          return dir_entry;
-        }
+// Claim the first free bit of a bitmap, scanning 64 bits at a time. A
+// bitmap fits in one block, so bs bounds the scan at compile time.
+// Returns the bit index, or -1 if all nbits are in use.
+ALWAYS_INLINE int claim_free_bit(unsigned char *bitmap, unsigned int nbits,
+  const unsigned int bs){
+  unsigned long long *words = (unsigned long long *) bitmap;
+  unsigned int word_count = (nbits + 63) / 64;
+  unsigned int i;
+
+  if (word_count > bs / sizeof(unsigned long long)){
+    word_count = bs / sizeof(unsigned long long);
+  }
+  for (i = 0; i < word_count; i++){
+    STATS_ADD(bitmap_words, 1);
+    if (words[i] != ~0ULL){
+      unsigned int bit = i * 64 + __builtin_ctzll(~words[i]);
+      if (bit >= nbits){
+        return -1;
       }
+      bitmap[bit / 8] |= 1 << (bit % 8);
+      return bit;
     }
-
-
   }
 
-  return NULL;
+  return -1;
 }
 
-struct ext2_dir_entry_2 *get_entry_in_block(const unsigned char *data_block,
-  const char *dir_entry_name){
-  struct ext2_dir_entry_2 *dir_entry;
-  const unsigned char *curr = data_block;
-  const unsigned char *end = (data_block + EXT2_BLOCK_SIZE);
+/*
+ * Variants of the hot lookups and bitmap scans specialized on block size
+ * and feature set, so block strides, indirect pointer counts and bitmap
+ * lengths are compile-time constants.
+ * disk_init() picks the ones matching the image into disk_ops.
+ */
+#define DEFINE_BLOCK_SIZE_VARIANTS(bs) \
+static struct ext2_dir_entry_2 *entry_in_block_##bs(const unsigned char *data_block, \
+  const char *dir_entry_name){ \
+  return scan_entries(data_block, bs, dir_entry_name); \
+} \
+static struct ext2_dir_entry_2 *dir_entry_in_inode_##bs(const struct ext2_inode *inode, \
+  const char *dir_entry_name){ \
+  return find_in_dir_inode(inode, dir_entry_name, bs); \
+} \
+static int claim_free_bit_##bs(unsigned char *bitmap, unsigned int nbits){ \
+  return claim_free_bit(bitmap, nbits, bs); \
+}
 
-  while (curr < end){
-    dir_entry = (struct ext2_dir_entry_2 *) curr;
+DEFINE_BLOCK_SIZE_VARIANTS(1024)
+DEFINE_BLOCK_SIZE_VARIANTS(2048)
+DEFINE_BLOCK_SIZE_VARIANTS(4096)
 
-    if (strncmp(dir_entry_name, dir_entry->name, dir_entry->name_len) == 0){
-      return dir_entry;
-    }
+static unsigned int lookup_path_filetype(const char *disk_path){
+  return walk_path(disk_path, 1);
+}
 
-    curr += dir_entry->rec_len;
+static unsigned int lookup_path_plain(const char *disk_path){
+  return walk_path(disk_path, 0);
+}
+
+static struct disk_ops {
+  unsigned int (*lookup_path)(const char *disk_path);
+  struct ext2_dir_entry_2 *(*dir_entry_in_inode)(const struct ext2_inode *inode,
+    const char *dir_entry_name);
+  struct ext2_dir_entry_2 *(*entry_in_block)(const unsigned char *data_block,
+    const char *dir_entry_name);
+  int (*claim_free_bit)(unsigned char *bitmap, unsigned int nbits);
+} disk_ops;
+
+// Pick the lookup and bitmap variants for the block size and features of the image
+static int select_disk_ops(){
+  switch (block_size){
+    case 1024:
+      disk_ops.dir_entry_in_inode = dir_entry_in_inode_1024;
+      disk_ops.entry_in_block = entry_in_block_1024;
+      disk_ops.claim_free_bit = claim_free_bit_1024;
+      break;
+    case 2048:
+      disk_ops.dir_entry_in_inode = dir_entry_in_inode_2048;
+      disk_ops.entry_in_block = entry_in_block_2048;
+      disk_ops.claim_free_bit = claim_free_bit_2048;
+      break;
+    case 4096:
+      disk_ops.dir_entry_in_inode = dir_entry_in_inode_4096;
+      disk_ops.entry_in_block = entry_in_block_4096;
+      disk_ops.claim_free_bit = claim_free_bit_4096;
+      break;
+    default:
+      return -1;
   }
 
-  return NULL;
+  if (sb->s_feature_incompat & EXT2_FEATURE_INCOMPAT_FILETYPE){
+    disk_ops.lookup_path = lookup_path_filetype;
+  } else {
+    disk_ops.lookup_path = lookup_path_plain;
+  }
+  return 0;
 }
 
-// Create an empty inode for use
-unsigned int create_inode(){
-  unsigned int last_inode = sb->s_free_inodes_count;
-  unsigned int curr_inode = 0;
+// Find inode index by the absolute disk path
+unsigned int get_inode_idx_by_path(const char *disk_path){
+  STATS_START(start);
+  STATS_SET(path_blocks, 0);
+  unsigned int inode_idx = disk_ops.lookup_path(disk_path);
+  STATS_STOP(STATS_OP_PATH_LOOKUP, start);
+  return inode_idx;
+}
 
-  while (curr_inode < last_inode){
-    struct ext2_group_desc *gd = (struct ext2_group_desc *)(disk +
-      (2 + curr_inode) * EXT2_BLOCK_SIZE);
+// Find the dir_entry by name inside an inode
+struct ext2_dir_entry_2 *get_dir_entry_in_inode(const struct ext2_inode *inode,
+  const char *dir_entry_name){
+  STATS_START(start);
+  struct ext2_dir_entry_2 *dir_entry = disk_ops.dir_entry_in_inode(inode, dir_entry_name);
+  STATS_STOP(STATS_OP_DIR_LOOKUP, start);
+  return dir_entry;
+}
 
-    // look for any free blocks
-    if (gd->bg_free_inodes_count > 0){
-      unsigned int inode_idx;
-
-      unsigned char *bitmap = (unsigned char *) (disk +
-        EXT2_BLOCK_SIZE * gd->bg_inode_bitmap);
-
-      // look for the next free inode
-      int curr_bit = -1;
-      unsigned int i, j;
-      for (i = 0; i < 4; i++){
-        for (j = 0; j < 8; j++){
-          if (!(bitmap[i] >> j) & 1){
-            curr_bit = i * 8 + j;
-            break;
-          }
-        }
-      }
+struct ext2_dir_entry_2 *get_entry_in_block(const unsigned char *data_block,
+  const char *dir_entry_name){
+  return disk_ops.entry_in_block(data_block, dir_entry_name);
+}
 
-      if (curr_bit == -1){
-        return 0;
-      }
+// Number of block groups on the disk
+unsigned int get_group_count(){
+  return (sb->s_blocks_count - sb->s_first_data_block + sb->s_blocks_per_group - 1)
+    / sb->s_blocks_per_group;
+}
 
-      inode_idx = curr_bit + 1;
-      unsigned char * single_byte = bitmap + curr_bit / 8;
-      *single_byte |= 1 << ( curr_bit % 8 );
+// Create an empty inode for use
+unsigned int create_inode(){
+  STATS_START(start);
+  struct ext2_group_desc *gd = get_group_desc();
+  unsigned int groups = get_group_count();
+  unsigned int inode_idx = 0;
+  unsigned int g;
+
+  for (g = 0; g < groups; g++){
+    // look for any free inodes
+    if (gd[g].bg_free_inodes_count == 0){
+      continue;
+    }
 
-      gd->bg_free_inodes_count -= 1;
-      return inode_idx;
+    unsigned char *bitmap = disk + block_size * gd[g].bg_inode_bitmap;
+    int bit = disk_ops.claim_free_bit(bitmap, sb->s_inodes_per_group);
+    if (bit == -1){
+      continue;
     }
-    curr_inode += sb->s_inodes_per_group;
+
+    gd[g].bg_free_inodes_count -= 1;
+    sb->s_free_inodes_count -= 1;
+    inode_idx = g * sb->s_inodes_per_group + bit + 1;
+    break;
   }
 
-  return 0;
+  STATS_STOP(STATS_OP_ALLOC_INODE, start);
+  return inode_idx;
 }
 
+// Create an empty block for use
 unsigned int create_block(){
-  unsigned int last_block= sb->s_free_blocks_count;
-  unsigned int curr_block = 0;
-
-  while (curr_block < last_block){
-    struct ext2_group_desc *gd = (struct ext2_group_desc *)(disk +
-      (2 + curr_block) * EXT2_BLOCK_SIZE);
+  STATS_START(start);
+  struct ext2_group_desc *gd = get_group_desc();
+  unsigned int groups = get_group_count();
+  unsigned int block_idx = 0;
+  unsigned int g;
 
+  for (g = 0; g < groups; g++){
     // look for any free blocks
-    if (gd->bg_free_blocks_count > 0){
-      unsigned int block_idx;
-
-      unsigned char *bitmap = (unsigned char *) (disk +
-        EXT2_BLOCK_SIZE * gd->bg_block_bitmap);
-
-      // look for the next free block
-      int curr_bit = -1;
-      unsigned int i, j;
-      for (i = 0; i < 4; i++){
-        for (j = 0; j < 8; j++){
-          if (!(bitmap[i] >> j) & 1){
-            curr_bit = i * 8 + j;
-            break;
-          }
-        }
-      }
-
-      if (curr_bit == -1){
-        return 0;
-      }
+    if (gd[g].bg_free_blocks_count == 0){
+      continue;
+    }
 
-      block_idx = curr_bit + 1;
-      unsigned char * single_byte = bitmap + curr_bit / 8;
-      *single_byte |= 1 << ( curr_bit % 8 );
+    // the last group may be shorter than s_blocks_per_group
+    unsigned int group_blocks = sb->s_blocks_count - sb->s_first_data_block
+      - g * sb->s_blocks_per_group;
+    if (group_blocks > sb->s_blocks_per_group){
+      group_blocks = sb->s_blocks_per_group;
+    }
 
-      gd->bg_free_blocks_count -= 1;
-      return block_idx;
+    unsigned char *bitmap = disk + block_size * gd[g].bg_block_bitmap;
+    int bit = disk_ops.claim_free_bit(bitmap, group_blocks);
+    if (bit == -1){
+      continue;
     }
-    curr_block += sb->s_blocks_per_group;
+
+    gd[g].bg_free_blocks_count -= 1;
+    sb->s_free_blocks_count -= 1;
+    block_idx = g * sb->s_blocks_per_group + bit + sb->s_first_data_block;
+    break;
   }
 
-  return 0;
+  STATS_STOP(STATS_OP_ALLOC_BLOCK, start);
+  return block_idx;
 }
 
+// Return an inode to the free pool
+void free_inode(unsigned int inode_idx){
+  struct ext2_group_desc *gd = get_group_desc();
+  unsigned int group = (inode_idx - 1) / sb->s_inodes_per_group;
+  unsigned int bit = (inode_idx - 1) % sb->s_inodes_per_group;
+  unsigned char *bitmap = disk + block_size * gd[group].bg_inode_bitmap;
+
+  bitmap[bit / 8] &= ~(1 << (bit % 8));
+  gd[group].bg_free_inodes_count += 1;
+  sb->s_free_inodes_count += 1;
+}
+
+// Return a block to the free pool
+void free_block(unsigned int block_idx){
+  struct ext2_group_desc *gd = get_group_desc();
+  unsigned int group = (block_idx - sb->s_first_data_block) / sb->s_blocks_per_group;
+  unsigned int bit = (block_idx - sb->s_first_data_block) % sb->s_blocks_per_group;
+  unsigned char *bitmap = disk + block_size * gd[group].bg_block_bitmap;
+
+  bitmap[bit / 8] &= ~(1 << (bit % 8));
+  gd[group].bg_free_blocks_count += 1;
+  sb->s_free_blocks_count += 1;
+}
@@ -7,12 +7,16 @@
 
 extern unsigned char *disk;
 extern struct ext2_super_block *sb;
+extern unsigned int block_size;  // of the open image, 1024 << s_log_block_size
 
 int disk_init(const char *image_path);
+struct ext2_group_desc *get_group_desc();
 
 // get inode
 unsigned int get_inode_idx_by_path(const char *disk_path);
 struct ext2_inode *get_inode_by_idx(unsigned int inode_idx);
+unsigned int get_inode_size();
+unsigned int get_group_count();
 struct ext2_dir_entry_2 *get_dir_entry_in_inode(const struct ext2_inode *inode,
   const char *dir_entry_name);
 struct ext2_dir_entry_2 *get_entry_in_block(const unsigned char *data_block,
@@ -20,8 +24,10 @@ struct ext2_dir_entry_2 *get_entry_in_block(const unsigned char *data_block,
 
 // create inode
 unsigned int create_inode();
+void free_inode(unsigned int inode_idx);
 
 // create block
 unsigned int create_block();
+void free_block(unsigned int block_idx);
 
 #endif
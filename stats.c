@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "stats.h"
+
+#ifdef EXT2_STATS
+
+// trace events past this are dropped (and counted) to keep the cost bounded
+#define STATS_TRACE_MAX 65536
+
+struct trace_event {
+  enum stats_op op;
+  unsigned long long start;
+  unsigned long long dur;
+};
+
+struct ext2_stats ext2_stats;
+
+static const char *op_names[STATS_OP_MAX] = {
+  "get_inode_idx_by_path",
+  "get_dir_entry_in_inode",
+  "create_inode",
+  "create_block"
+};
+
+static int print_summary = 0;
+static FILE *trace_file = NULL;
+static struct trace_event *trace_events = NULL;
+static unsigned int trace_len = 0;
+static unsigned long long trace_dropped = 0;
+static unsigned long long clock_origin = 0;
+
+unsigned long long stats_clock(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Record one timed op into its histogram and the trace buffer
+void stats_record(enum stats_op op, unsigned long long start){
+  unsigned long long dur = stats_clock() - start;
+
+  ext2_stats.op_count[op]++;
+  ext2_stats.op_total_ns[op] += dur;
+
+  int bucket = dur ? 63 - __builtin_clzll(dur) : 0;
+  if (bucket >= STATS_HIST_BUCKETS){
+    bucket = STATS_HIST_BUCKETS - 1;
+  }
+  ext2_stats.op_hist[op][bucket]++;
+
+  if (op == STATS_OP_PATH_LOOKUP && ext2_stats.path_blocks > ext2_stats.max_path_blocks){
+    ext2_stats.max_path_blocks = ext2_stats.path_blocks;
+  }
+
+  if (trace_events){
+    if (trace_len < STATS_TRACE_MAX){
+      trace_events[trace_len].op = op;
+      trace_events[trace_len].start = start;
+      trace_events[trace_len].dur = dur;
+      trace_len++;
+    } else {
+      trace_dropped++;
+    }
+  }
+}
+
+static void print_stats(){
+  int op, i;
+
+  fprintf(stderr, "--- ext2 stats ---\n");
+  fprintf(stderr, "dir blocks touched:    %llu (max %llu per path)\n",
+    ext2_stats.blocks_touched, ext2_stats.max_path_blocks);
+  fprintf(stderr, "dir entries compared:  %llu\n", ext2_stats.entries_compared);
+  fprintf(stderr, "bitmap words scanned:  %llu\n", ext2_stats.bitmap_words);
+
+  for (op = 0; op < STATS_OP_MAX; op++){
+    unsigned long long count = ext2_stats.op_count[op];
+    if (count == 0){
+      continue;
+    }
+
+    fprintf(stderr, "%s: %llu calls, avg %llu ns\n", op_names[op], count,
+      ext2_stats.op_total_ns[op] / count);
+    for (i = 0; i < STATS_HIST_BUCKETS; i++){
+      if (ext2_stats.op_hist[op][i]){
+        fprintf(stderr, "  [%10llu ns, %10llu ns) %llu\n", 1ULL << i,
+          1ULL << (i + 1), ext2_stats.op_hist[op][i]);
+      }
+    }
+  }
+}
+
+// Write the buffered events in the Chrome trace event format
+static void write_trace(){
+  unsigned int i;
+  int pid = getpid();
+
+  fprintf(trace_file, "{\"traceEvents\":[\n");
+  for (i = 0; i < trace_len; i++){
+    struct trace_event *ev = &trace_events[i];
+    fprintf(trace_file,
+      "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}%s\n",
+      op_names[ev->op], pid, pid, (ev->start - clock_origin) / 1000.0,
+      ev->dur / 1000.0, i + 1 < trace_len ? "," : "");
+  }
+  fprintf(trace_file, "],\"otherData\":{\"dropped_events\":\"%llu\"}}\n", trace_dropped);
+  fclose(trace_file);
+}
+
+static void stats_exit(){
+  if (print_summary){
+    print_stats();
+  }
+  if (trace_file){
+    write_trace();
+  }
+}
+
+#endif
+
+// Remove the instrumentation options from argv so the tools' own positional
+// argument handling is left untouched.
+void stats_init(int *argc, char **argv){
+  int i, kept = 1;
+
+  for (i = 1; i < *argc; i++){
+    if (strcmp(argv[i], "--stats") == 0){
+#ifdef EXT2_STATS
+      print_summary = 1;
+#else
+      fprintf(stderr, "--stats: built without EXT2_STATS, ignored\n");
+#endif
+    } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < *argc){
+      i++;
+#ifdef EXT2_STATS
+      trace_file = fopen(argv[i], "w");
+      if (trace_file == NULL){
+        perror(argv[i]);
+        exit(1);
+      }
+      trace_events = malloc(STATS_TRACE_MAX * sizeof(struct trace_event));
+      if (trace_events == NULL){
+        perror("malloc");
+        exit(1);
+      }
+#else
+      fprintf(stderr, "--trace: built without EXT2_STATS, ignored\n");
+#endif
+    } else {
+      argv[kept++] = argv[i];
+    }
+  }
+  argv[kept] = NULL;
+  *argc = kept;
+
+#ifdef EXT2_STATS
+  clock_origin = stats_clock();
+  atexit(stats_exit);
+#endif
+}
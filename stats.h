@@ -0,0 +1,60 @@
+#ifndef STATS_H
+#define STATS_H
+
+/*
+ * Lightweight instrumentation for the shared ext2 routines.
+ *
+ * Everything in here compiles away unless the tools are built with
+ * -DEXT2_STATS (i.e. `make STATS=1`). When enabled, a tool accepts
+ * `--stats` to print a summary to stderr on exit and `--trace <file>` to
+ * write a Chrome trace (chrome://tracing, Perfetto) of every timed op.
+ */
+
+// timed operations, each gets its own latency histogram
+enum stats_op {
+  STATS_OP_PATH_LOOKUP,
+  STATS_OP_DIR_LOOKUP,
+  STATS_OP_ALLOC_INODE,
+  STATS_OP_ALLOC_BLOCK,
+  STATS_OP_MAX
+};
+
+// strip --stats / --trace <file> from argv, must be called first in main
+void stats_init(int *argc, char **argv);
+
+#ifdef EXT2_STATS
+
+// latency buckets are powers of two in nanoseconds: [2^i, 2^(i+1))
+#define STATS_HIST_BUCKETS 32
+
+struct ext2_stats {
+  unsigned long long blocks_touched;    // dir blocks read by lookups
+  unsigned long long entries_compared;  // dir entries compared by name
+  unsigned long long bitmap_words;      // bitmap words scanned by allocs
+  unsigned long long path_blocks;       // blocks touched by current path
+  unsigned long long max_path_blocks;   // most blocks touched by one path
+  unsigned long long op_count[STATS_OP_MAX];
+  unsigned long long op_total_ns[STATS_OP_MAX];
+  unsigned long long op_hist[STATS_OP_MAX][STATS_HIST_BUCKETS];
+};
+
+extern struct ext2_stats ext2_stats;
+
+unsigned long long stats_clock();
+void stats_record(enum stats_op op, unsigned long long start);
+
+#define STATS_ADD(counter, n) (ext2_stats.counter += (n))
+#define STATS_SET(counter, n) (ext2_stats.counter = (n))
+#define STATS_START(var)      unsigned long long var = stats_clock()
+#define STATS_STOP(op, var)   stats_record((op), (var))
+
+#else
+
+#define STATS_ADD(counter, n) ((void)0)
+#define STATS_SET(counter, n) ((void)0)
+#define STATS_START(var)
+#define STATS_STOP(op, var)   ((void)0)
+
+#endif
+
+#endif